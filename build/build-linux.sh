@@ -1,2 +1,4 @@
 cd ..
-c++ risc64-a.cpp -o risc64-a -std=c++2a -Wno-format-security
\ No newline at end of file
+c++ risc64-a.cpp -o risc64-a -std=c++2a -Wno-format-security -pthread
+c++ risc64-l.cpp -o risc64-l -std=c++2a -Wno-format-security -pthread
+c++ risc64-d.cpp -o risc64-d -std=c++2a -Wno-format-security -pthread
\ No newline at end of file
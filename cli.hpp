@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <vector>
 #include <string>
 #include <unordered_map>
@@ -65,6 +66,21 @@ namespace cli {
             int i = 0;
             
             DEFINE_SETTING("--output", "-o", "output");
+            DEFINE_SWITCH("--optimize", "-O", "optimize");
+            DEFINE_SWITCH("--object", "-c", "object");
+            DEFINE_SETTING("--map", "-m", "map");
+            DEFINE_SETTING("--map-text", "-mt", "map-text");
+            DEFINE_SWITCH("--verify", "-v", "verify");
+            DEFINE_SWITCH("--interactive", "-i", "interactive");
+            DEFINE_SWITCH("--hex", "-x", "hex");
+            DEFINE_SETTING("--ihex", "-ih", "ihex");
+            DEFINE_SETTING("--srec", "-sr", "srec");
+            DEFINE_SETTING("--listing", "-l", "listing");
+            DEFINE_SETTING("--deps", "-MF", "deps");
+            DEFINE_SETTING("--report", "-r", "report");
+            DEFINE_SETTING("--report-diff", "-rd", "report-diff");
+            DEFINE_SETTING("--cost-table", "-ct", "cost-table");
+            DEFINE_SETTING("--trace", "-t", "trace");
 
             if (cli.size()) {
                 if (cli.at(0).size()) {
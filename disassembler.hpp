@@ -0,0 +1,314 @@
+#pragma once
+
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <array>
+
+#include "instruction.hpp"
+#include "parser.hpp"
+#include "emitter.hpp"
+#include "parallel.hpp"
+#include "trace.hpp"
+#include "log.hpp"
+
+/*
+    Disassembler
+
+    Decoding is driven by the emitter's tables, so anything encode can emit
+    can be decoded back:
+        byte 0: cond (3 bits), type (2 bits), encoding class (3 bits)
+        byte 1: opcode
+        bit 16: sign, bits 17-18: operand size (absent for no_operand)
+        bit 19+: registers (5 bits each), then the constant up to the last bit
+
+    Instruction boundaries are found first in a single table-driven scan, the
+    instructions between them are then decoded across threads.
+*/
+
+namespace disassembler {
+    namespace detail {
+        using namespace risc64;
+
+        // ALU unary mnemonics share their type and opcode with ALU binary ones,
+        // they're told apart by having a single register operand
+        const std::array <std::string, 4> unary = { "not", "i", "d", "abs" };
+
+        inline bool is_unary(const std::string& id) {
+            return std::find(unary.begin(), unary.end(), id) != unary.end();
+        }
+
+        // (type << 8) | opcode -> mnemonic ids
+        std::unordered_map <uint16_t, std::vector <std::string>> id_table;
+
+        // Instruction length, indexed by (encoding class << 2) | operand size
+        std::array <uint8_t, 32> length_table;
+
+        void build_tables() {
+            if (id_table.size()) return;
+
+            for (const emitter::detail::id_entry& e : emitter::detail::id_table) {
+                id_table[(e.type << 8) | e.opcode].push_back(std::string(e.id));
+            }
+
+            for (auto& ids : id_table) std::sort(ids.second.begin(), ids.second.end());
+
+            for (uint8_t ec = 0; ec < 8; ec++) {
+                for (uint8_t size = 0; size < 4; size++) {
+                    instruction i;
+                    i.ec = (encoding_class)(ec << 2);
+                    i.m.size = (operand_size)size;
+                    length_table[(ec << 2) | size] = parser::detail::parse_instruction_length(i);
+                }
+            }
+        }
+
+        struct span {
+            uint64_t    offset;
+            uint8_t     length;
+
+            // False if the bytes don't start a known instruction, length is 1 then
+            bool        valid;
+        };
+
+        // Finds the boundaries of every instruction in [p, p + size)
+        std::vector <span> scan(const uint8_t* p, size_t size) {
+            std::vector <span> spans;
+
+            spans.reserve(size / 3);
+
+            for (uint64_t offset = 0; offset < size;) {
+                uint8_t ec = p[offset] >> 5,
+                        length = 2;
+
+                if (ec != ((uint8_t)encoding_class::no_operand >> 2)) {
+                    length = ((offset + 2) < size) ? length_table[(ec << 2) | ((p[offset+2] >> 1) & 3)] : 0;
+                }
+
+                bool valid = length && ((offset + length) <= size);
+
+                spans.push_back({offset, valid ? length : (uint8_t)1, valid});
+
+                offset += spans.back().length;
+            }
+
+            return spans;
+        }
+
+        // Returns false if the encoding doesn't map to a known mnemonic
+        bool decode(const uint8_t* p, uint8_t length, instruction& i) {
+            uint64_t word = 0;
+
+            for (size_t b = 0; b < length; b++) word |= (uint64_t)p[b] << (b*8);
+
+            i.m.cond = (condition)(word & 7);
+            i.ec     = (encoding_class)((word >> 3) & 0x1c);
+
+            uint8_t type   = (word >> 3) & 3,
+                    opcode = (word >> 8) & 0xff;
+
+            i.m.size = operand_size::w;
+            i.m.sign = operand_sign::u;
+
+            if (i.ec != encoding_class::no_operand) {
+                i.m.sign = (operand_sign)((word >> 16) & 1);
+                i.m.size = (operand_size)((word >> 17) & 3);
+            }
+
+            size_t regs = 0;
+            bool   has_const = false;
+
+            switch (i.ec) {
+                case encoding_class::t_register_all:            regs = 3; break;
+                case encoding_class::t_register_single_const:   regs = 2; has_const = true; break;
+                case encoding_class::d_register_all:            regs = 2; break;
+                case encoding_class::d_register_single_const:   regs = 1; has_const = true; break;
+                case encoding_class::s_register:                regs = 1; break;
+                case encoding_class::s_const:                   has_const = true; break;
+                case encoding_class::no_operand:                break;
+                default: return false;
+            }
+
+            auto ids = id_table.find((type << 8) | opcode);
+
+            if (ids == id_table.end()) return false;
+
+            i.m.id.clear();
+
+            for (const std::string& id : ids->second) {
+                if (is_unary(id) == (i.ec == encoding_class::s_register)) { i.m.id = id; break; }
+            }
+
+            if (i.m.id.empty()) i.m.id = ids->second.front();
+
+            size_t sv = 19;
+
+            i.operands.clear();
+
+            for (size_t r = 0; r < regs; r++) {
+                operand o;
+                o.type = operand_type::r;
+                o.reg_type = register_type::gpr;
+                o.reg_num = (word >> sv) & 0x1f;
+                o.position = r;
+                i.operands.push_back(o);
+                sv += 5;
+            }
+
+            if (has_const) {
+                size_t bits = length*8 - sv;
+
+                operand o;
+                o.type = operand_type::c;
+                o.const_value = (word >> sv) & ((bits >= 64) ? ~0ull : ((1ull << bits) - 1));
+                o.position = regs;
+                i.operands.push_back(o);
+            }
+
+            return true;
+        }
+    }
+
+    struct decoded {
+        uint64_t                    address;
+        uint8_t                     length;
+        bool                        valid;
+        parser::detail::instruction i;
+    };
+
+    // Decodes [p, p + size) using up to threads workers (0 to use every core)
+    std::vector <decoded> disassemble(const uint8_t* p, size_t size, size_t threads = 0) {
+        using namespace detail;
+
+        trace::scope s("disassembler::disassemble");
+
+        build_tables();
+
+        std::vector <span> spans;
+
+        {
+            trace::scope t("disassembler::scan");
+            spans = scan(p, size);
+        }
+
+        std::vector <decoded> out(spans.size());
+
+        size_t chunks = threads ? threads : parallel::thread_count(spans.size()),
+               per_chunk = (spans.size() + chunks - 1) / std::max<size_t>(chunks, 1);
+
+        parallel::parallel_for(chunks, [&](size_t c) {
+            size_t first = c * per_chunk,
+                   last  = std::min(spans.size(), first + per_chunk);
+
+            for (size_t n = first; n < last; n++) {
+                decoded& d = out[n];
+                d.address = spans[n].offset;
+                d.length  = spans[n].length;
+                d.valid   = spans[n].valid && decode(p + d.address, d.length, d.i);
+            }
+        });
+
+        return out;
+    }
+
+    // Formats d as a listing line: address, bytes, then the instruction
+    std::string format_line(const decoded& d, const uint8_t* image) {
+        char buf[64];
+        int n = snprintf(buf, sizeof(buf), "%08llx  ", (unsigned long long)d.address);
+
+        for (size_t b = 0; b < 8; b++) {
+            n += (b < d.length) ? snprintf(buf + n, sizeof(buf) - n, "%02x ", image[d.address + b])
+                                : snprintf(buf + n, sizeof(buf) - n, "   ");
+        }
+
+        std::string s(buf, n);
+
+        if (d.valid) {
+            s += " " + print_source(d.i);
+        } else {
+            snprintf(buf, sizeof(buf), " .byte #0x%02x;", image[d.address]);
+            s += buf;
+        }
+
+        return s;
+    }
+
+    // True if ids a and b encode the same, like emitter::detail::encode ids missing from id_table
+    // encode as ALU opcode 0. Unary ALU ids share opcodes with binary ones, e.g. "not %r1, %r2;"
+    // is encoded exactly like "add %r1, %r2;", and decodes as the latter
+    bool same_opcode(std::string_view a, std::string_view b) {
+        const emitter::detail::id_entry* ea = emitter::detail::find_id(a);
+        const emitter::detail::id_entry* eb = emitter::detail::find_id(b);
+
+        return ((ea ? ea->type : 0) == (eb ? eb->type : 0)) &&
+               ((ea ? ea->opcode : 0) == (eb ? eb->opcode : 0));
+    }
+
+    // Re-decodes image and compares it against the program it was assembled from, returns 0 on mismatch
+    int verify(const std::vector <uint8_t>& image, const std::vector <parser::detail::instruction>& program) {
+        using namespace risc64;
+
+        trace::scope s("disassembler::verify");
+
+        std::vector <decoded> d = disassemble(image.data(), image.size());
+
+        size_t n = 0, errors = 0;
+
+        for (const instruction& i : program) {
+            if (i.label.size()) continue;
+
+            if (n >= d.size()) {
+                _log(error, "%s: Image ends before instruction %zu", __FUNCTION__, n);
+                return 0;
+            }
+
+            const decoded& e = d[n++];
+
+            bool ok = e.valid && same_opcode(e.i.m.id, i.m.id) && (e.i.m.cond == i.m.cond) &&
+                      (e.i.ec == i.ec) && (e.i.operands.size() == i.operands.size());
+
+            if (ok && (i.ec != encoding_class::no_operand)) {
+                ok = (e.i.m.size == i.m.size) && (e.i.m.sign == i.m.sign);
+            }
+
+            for (size_t k = 0; ok && (k < i.operands.size()); k++) {
+                const operand &a = e.i.operands[k], &b = i.operands[k];
+
+                if (a.type != b.type) { ok = false; break; }
+
+                if (b.type == operand_type::r) {
+                    ok = (a.reg_num == b.reg_num);
+                } else {
+                    size_t bits = e.length*8 - emitter::detail::const_shift(i, b);
+                    uint64_t mask = (bits >= 64) ? ~0ull : ((1ull << bits) - 1);
+                    ok = (a.const_value == (b.const_value & mask));
+                }
+            }
+
+            if (!ok) {
+                if (errors++ < 16) {
+                    _log(error, "%s: %s: Mismatch at 0x%llx: assembled \"%s\", decoded \"%s\"", source::locate(i.offset).c_str(), __FUNCTION__,
+                         (unsigned long long)e.address, print_source(i).c_str(), e.valid ? print_source(e.i).c_str() : "<invalid>");
+                }
+            }
+        }
+
+        if (n != d.size()) {
+            _log(error, "%s: Image has %zu trailing instruction(s)", __FUNCTION__, d.size() - n);
+            return 0;
+        }
+
+        if (errors) {
+            _log(error, "%s: %zu mismatch(es)", __FUNCTION__, errors);
+            return 0;
+        }
+
+        _log(ok, "%s: %zu instruction(s) verified", __FUNCTION__, n);
+
+        return 1;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <array>
+
+#include "instruction.hpp"
+#include "lexer.hpp"
+#include "parser.hpp"
+#include "emitter.hpp"
+
+/*
+    Compile-time assembly
+
+        constexpr auto stub = risc64::assemble<"add %r1, %r2, %r3; ret;">();
+
+    gives the code as a std::array <uint8_t, N>. Mnemonics, operands, encoding
+    classes, lengths and encodings go through the same functions the
+    assembler uses at runtime, only lexing is done by lexer::scan instead
+    of the stream lexer, with the same separator rules. Labels and
+    references to them are resolved, the code is placed at address 0.
+    Directives, .equ names and macros aren't available. Malformed input
+    fails to compile, the error points at the throw below that was reached.
+    risc64-a.cpp checks the output against known bytes.
+*/
+
+namespace risc64 {
+    // String literal usable as a template argument
+    template <size_t N> struct fixed_string {
+        char text[N];
+
+        constexpr fixed_string(const char (&s)[N]) {
+            std::copy_n(s, N, text);
+        }
+
+        constexpr std::string_view view() const {
+            return std::string_view(text, N - 1);
+        }
+    };
+
+    namespace detail {
+        // Assembles text, writing the code to out unless it's null. Returns the size of the code
+        constexpr size_t assemble(std::string_view text, uint8_t* out) {
+            using namespace parser::detail;
+
+            std::vector <lexer::token> tokens;
+
+            if (!lexer::scan(text, tokens)) throw "risc64::assemble: Unexpected character or missing separator";
+
+            std::vector <instruction> program;
+
+            for (size_t n = 0; n < tokens.size(); n++) {
+                instruction i;
+
+                i.offset = tokens[n].offset;
+
+                if (tokens[n].id == lexer::k_label) {
+                    i.label = tokens[n].data;
+                    program.push_back(i);
+                    continue;
+                }
+
+                if (tokens[n].id != lexer::k_instruction) throw "risc64::assemble: Expected a mnemonic";
+
+                if (!parse_instruction_mnemonic(tokens[n].data, i.m)) throw "risc64::assemble: Unknown mnemonic";
+
+                for (n++; (n < tokens.size()) && (tokens[n].id != lexer::k_semicolon); n++) {
+                    operand o;
+
+                    if (!parse_operand(tokens[n], o)) {
+                        if (tokens[n].id == lexer::k_number) throw "risc64::assemble: Number out of range";
+
+                        throw "risc64::assemble: Malformed operand";
+                    }
+
+                    o.position = i.operands.size();
+                    i.operands.push_back(o);
+                }
+
+                if (n >= tokens.size()) throw "risc64::assemble: Expected ';'";
+
+                parse_encoding_class(i);
+                program.push_back(i);
+            }
+
+            // Assign an address to every label
+            std::vector <std::pair <std::string, uint64_t>> labels;
+            uint64_t address = 0;
+
+            for (instruction& i : program) {
+                if (i.label.size()) {
+                    for (auto& l : labels) {
+                        if (l.first == i.label) throw "risc64::assemble: Redefinition of label";
+                    }
+                    labels.push_back({i.label, address});
+                }
+                address += parse_instruction_length(i);
+            }
+
+            if (!out) return address;
+
+            for (instruction& i : program) {
+                if (i.label.size()) continue;
+
+                for (operand& o : i.operands) {
+                    if (o.symbol.empty()) continue;
+
+                    auto l = std::find_if(labels.begin(), labels.end(), [&](auto& l) { return l.first == o.symbol; });
+
+                    if (l == labels.end()) throw "risc64::assemble: Undefined symbol";
+
+                    o.const_value = l->second;
+                }
+
+                uint64_t opcode = emitter::detail::encode(i);
+
+                for (size_t b = 0; b < parse_instruction_length(i); b++) *out++ = (uint8_t)(opcode >> (b*8));
+            }
+
+            return address;
+        }
+    }
+
+    template <fixed_string S> consteval auto assemble() {
+        constexpr size_t size = detail::assemble(S.view(), nullptr);
+
+        std::array <uint8_t, size> code = {};
+
+        detail::assemble(S.view(), code.data());
+
+        return code;
+    }
+}
\ No newline at end of file
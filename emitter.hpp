@@ -1,22 +1,22 @@
 #pragma once
 
 #include <unordered_map>
+#include <unordered_set>
+#include <string_view>
 #include <ostream>
-#include <sstream>
-#include <iomanip>
 #include <memory>
 #include <array>
+#include <vector>
 
+#include "global.hpp"
 #include "parser.hpp"
+#include "source.hpp"
+#include "object.hpp"
+#include "sink.hpp"
+#include "trace.hpp"
 
 namespace emitter {
     namespace detail {
-        template <class T> std::string hex(T value) {
-            std::stringstream ss;
-            ss << std::setfill('0') << std::setw(sizeof(T)*2) << std::hex << (unsigned long long)value;
-            return ss.str();
-        }
-
         enum condition {
             z = 0,	// z: zero/equal (0, 0b000)
             c,		// c: overflow/carry (1, 0b001)
@@ -68,55 +68,53 @@ namespace emitter {
             bool 	    operand_sign = 0;
         };
 
-        std::unordered_map <std::string, uint8_t> id_opcode_map = {
-        //    ALU binary:           ALU unary:            LSU:                  BNJ:                  SYS:
-            { "add"     , 0x0  }, { "not"     , 0x0  }, { "l"       , 0x0  }, { "b"       , 0x0  }, { "halt"    , 0xfe },
-            { "sub"     , 0x1  }, { "i"       , 0x1  }, { "s"       , 0x1  }, { "j"       , 0x1  },
-            { "rsub"    , 0x2  }, { "d"       , 0x2  }, { "lr"      , 0x2  }, { "call"    , 0xfe },
-            { "mul"     , 0x3  }, { "abs"     , 0x3  }, { "lsp"     , 0xe0 }, { "ret"     , 0xff },
-            { "div"     , 0x4  },                       { "push"    , 0xd0 },
-            { "rdiv"    , 0x5  },                       { "pop"     , 0xd1 },
-            { "mod"     , 0x6  },
-            { "and"     , 0x7  },
-            { "or"      , 0x8  },
-            { "xor"     , 0x9  },
-            { "sl"      , 0xa  },
-            { "sr"      , 0xb  },
-            { "cmp"     , 0xc  },
-            { "test"    , 0xd  },
-            { "addsp"   , 0xe0 },
-            { "subsp"   , 0xe1 },
+        struct id_entry {
+            std::string_view    id;
+            uint8_t             type,
+                                opcode;
         };
 
-        std::unordered_map <std::string, uint8_t> id_type_map = {
-        //    ALU binary:          ALU unary:           LSU:                 BNJ:                 SYS:
-            { "add"     , 0x0 }, { "not"     , 0x0 }, { "l"       , 0x1 }, { "b"       , 0x2 }, { "halt"    , 0x3 },
-            { "sub"     , 0x0 }, { "i"       , 0x0 }, { "s"       , 0x1 }, { "j"       , 0x2 },
-            { "rsub"    , 0x0 }, { "d"       , 0x0 }, { "lr"      , 0x1 }, { "call"    , 0x2 },
-            { "mul"     , 0x0 }, { "abs"     , 0x0 }, { "lsp"     , 0x1 }, { "ret"     , 0x2 },                     
-            { "div"     , 0x0 },                      { "push"    , 0x1 },
-            { "rdiv"    , 0x0 },                      { "pop"     , 0x1 },
-            { "mod"     , 0x0 },
-            { "and"     , 0x0 },
-            { "or"      , 0x0 },
-            { "xor"     , 0x0 },
-            { "sl"      , 0x0 },
-            { "sr"      , 0x0 },
-            { "cmp"     , 0x0 },
-            { "test"    , 0x0 },
-            { "addsp"   , 0x0 },
-            { "subsp"   , 0x0 },
+        // Instruction class and opcode of every mnemonic id
+        constexpr id_entry id_table[] = {
+        //  ALU binary:                ALU unary:                 LSU:                       BNJ:                       SYS:
+            { "add"   , alu, 0x0  },   { "not"   , alu, 0x0  },   { "l"     , lsu, 0x0  },   { "b"     , bnj, 0x0  },   { "halt"  , sys, 0xfe },
+            { "sub"   , alu, 0x1  },   { "i"     , alu, 0x1  },   { "s"     , lsu, 0x1  },   { "j"     , bnj, 0x1  },
+            { "rsub"  , alu, 0x2  },   { "d"     , alu, 0x2  },   { "lr"    , lsu, 0x2  },   { "call"  , bnj, 0xfe },
+            { "mul"   , alu, 0x3  },   { "abs"   , alu, 0x3  },   { "lsp"   , lsu, 0xe0 },   { "ret"   , bnj, 0xff },
+            { "div"   , alu, 0x4  },                              { "push"  , lsu, 0xd0 },
+            { "rdiv"  , alu, 0x5  },                              { "pop"   , lsu, 0xd1 },
+            { "mod"   , alu, 0x6  },
+            { "and"   , alu, 0x7  },
+            { "or"    , alu, 0x8  },
+            { "xor"   , alu, 0x9  },
+            { "sl"    , alu, 0xa  },
+            { "sr"    , alu, 0xb  },
+            { "cmp"   , alu, 0xc  },
+            { "test"  , alu, 0xd  },
+            { "addsp" , alu, 0xe0 },
+            { "subsp" , alu, 0xe1 },
         };
 
-        uint64_t encode(parser::detail::instruction& i) {
+        // Returns the entry for id, or nullptr if it isn't in id_table
+        constexpr const id_entry* find_id(std::string_view id) {
+            for (const id_entry& e : id_table) {
+                if (e.id == id) return &e;
+            }
+            return nullptr;
+        }
+
+        // Usable in constant expressions, see embed.hpp. Ids missing from id_table encode as ALU opcode 0
+        constexpr uint64_t encode(const parser::detail::instruction& i) {
+            const id_entry* e = find_id(i.m.id);
+
             size_t sv = 19;
             uint64_t opcode = 0;
 
             // Encode common fields
             opcode  |= (uint8_t)i.m.cond
                     | ((uint8_t)i.ec << 3)
-                    | (id_type_map[i.m.id] << 3)
-                    | (id_opcode_map[i.m.id] << 8);
+                    | ((e ? e->type : 0) << 3)
+                    | ((e ? e->opcode : 0) << 8);
 
             if (!(i.ec == parser::detail::encoding_class::no_operand)) {
                 opcode  |= ((uint8_t)i.m.sign << 16)
@@ -124,7 +122,7 @@ namespace emitter {
             }
 
             // Encode operands
-            for (parser::detail::operand& o: i.operands) {
+            for (const parser::detail::operand& o: i.operands) {
                 if (o.type == parser::detail::operand_type::r) {
                     opcode |= (o.reg_num << sv);
                     sv += 5;
@@ -135,36 +133,234 @@ namespace emitter {
             }
             return opcode;
         }
+
+        // Bit position at which encode places the constant operand c
+        inline uint8_t const_shift(const parser::detail::instruction& i, const parser::detail::operand& c) {
+            uint8_t sv = 19;
+
+            for (const parser::detail::operand& o : i.operands) {
+                if (&o == &c) break;
+                if (o.type == parser::detail::operand_type::r) sv += 5;
+            }
+
+            return sv;
+        }
+
+        inline std::ostream& stream() {
+            return output_to_stdout ? std::cout : *output;
+        }
+
+        // Every encoded instruction is fed to each of these
+        std::vector <std::unique_ptr <sink::base>> sinks;
+
+        // Addresses of the labels in the program being assembled
+        std::unordered_map <std::string, uint64_t> labels;
+
+        // Size of the assembled program in bytes
+        uint64_t image_size = 0;
+
+        // The program as it was encoded, with symbolic constants resolved
+        std::vector <parser::detail::instruction> program;
+
+        // The encoded program
+        std::vector <uint8_t> image;
+
+        // Address of image[0], past zero once release() dropped the code before it
+        uint64_t image_base = 0;
+
+        // Object being built when output_object is set
+        object::file obj;
+
+        std::unordered_map <std::string, uint32_t> symbol_index;
+
+        // Labels exported from objects, see the .global directive
+        std::unordered_set <std::string> globals;
+
+        // Returns the index of the symbol called name, adding an undefined one if needed
+        uint32_t get_symbol(const std::string& name) {
+            auto s = symbol_index.find(name);
+
+            if (s != symbol_index.end()) return s->second;
+
+            obj.symbols.push_back({name, 0, 0, false, false});
+
+            return symbol_index[name] = obj.symbols.size() - 1;
+        }
     }
 
-    static void assemble() {
-        parser::detail::instruction i;
+    // Assembles everything in parser::output and appends it to the image.
+    // May be called again with more input, labels stay defined across calls
+    static int assemble() {
+        using namespace detail;
+
+        trace::scope s("emitter::assemble");
+
+        size_t first = program.size();
+        uint64_t base = image_size;
+
+        while (!parser::output.eof()) program.push_back(parser::output.get());
+
+        // Labels defined by this call, so a failed call can be undone
+        std::vector <std::string> defined;
+
+        auto rollback = [&]() {
+            for (std::string& l : defined) labels.erase(l);
+            program.resize(first);
+            image.resize(base - image_base);
+            image_size = base;
+            return 0;
+        };
+
+        // Assign an address to every label
+        uint64_t address = base;
+
+        for (size_t n = first; n < program.size(); n++) {
+            parser::detail::instruction& i = program[n];
+
+            if (i.label.size()) {
+                if (!labels.insert({i.label, address}).second) {
+                    _log(error, "%s: %s: Redefinition of label \"%s\"", source::locate(i.offset).c_str(), __FUNCTION__, i.label.c_str());
+                    return rollback();
+                }
+                defined.push_back(i.label);
+            }
+            address += parser::detail::parse_instruction_length(i);
+        }
+
+        image_size = address;
+
+        uint32_t text = 0;
+
+        if (output_object) {
+            text = obj.get_section(".text");
 
-        if (parser::output.eof()) return;
+            // Only .global labels are exported
+            for (std::string& l : defined) {
+                if (!globals.count(l)) continue;
+
+                uint32_t s = get_symbol(l);
+                obj.symbols[s].section = text;
+                obj.symbols[s].value = labels[l];
+                obj.symbols[s].defined = true;
+                obj.symbols[s].global = true;
+            }
+        }
+
+        address = base;
+
+        image.reserve(image_size - image_base);
+
+        for (size_t n = first; n < program.size(); n++) {
+            parser::detail::instruction& i = program[n];
+
+            if (i.label.size()) continue;
 
-        while (!parser::output.eof()) {
-            i = parser::output.get();
-            
             size_t len = parser::detail::parse_instruction_length(i);
 
-            uint64_t opcode = detail::encode(i);
+            // Resolve symbolic constants, objects leave them all to the linker:
+            // labels defined here relative to .text, anything else through a symbol
+            for (parser::detail::operand& o : i.operands) {
+                if (o.symbol.empty()) continue;
 
-            for (int i = 0; i < len; i++) {
-                uint8_t masked = (uint8_t)((opcode & (0xffull << (i*8))) >> (i*8));
-                if (output_to_stdout) {
-                    std::cout.put(masked);
+                if (output_object) {
+                    object::relocation r;
+                    r.section = text;
+                    r.offset = address;
+                    r.shift = const_shift(i, o);
+                    r.length = len;
+
+                    auto l = labels.find(o.symbol);
+
+                    if (l != labels.end()) {
+                        r.kind = object::to_section;
+                        r.target = text;
+                        r.addend = l->second;
+                    } else {
+                        r.kind = object::to_symbol;
+                        r.target = get_symbol(o.symbol);
+                    }
+
+                    obj.relocations.push_back(r);
+
+                    o.const_value = 0;
                 } else {
-                    detail::output->put(masked);
+                    auto l = labels.find(o.symbol);
+
+                    if (l == labels.end()) {
+                        _log(error, "%s: %s: Undefined symbol \"%s\"", source::locate(o.offset).c_str(), __FUNCTION__, o.symbol.c_str());
+                        return rollback();
+                    }
+
+                    o.const_value = l->second;
                 }
             }
+
+            uint64_t opcode = encode(i);
+
+            for (int i = 0; i < len; i++) {
+                uint8_t masked = (uint8_t)((opcode & (0xffull << (i*8))) >> (i*8));
+                image.push_back(masked);
+            }
+
+            address += len;
+        }
+
+        if (output_object) {
+            obj.sections[text].data = image;
+            object::write(stream(), obj);
+        }
+
+        // Only a call that succeeded reaches the sinks
+        address = base;
+
+        for (size_t n = first; n < program.size(); n++) {
+            parser::detail::instruction& i = program[n];
+
+            if (i.label.size()) {
+                for (auto& s : sinks) s->label(address, i.label);
+                continue;
+            }
+
+            size_t len = parser::detail::parse_instruction_length(i);
+
+            for (auto& s : sinks) s->put(address, image.data() + (address - image_base), len, i);
+
+            address += len;
         }
+
+        for (auto& s : sinks) s->flush();
+
+        return 1;
+    }
+
+    // Drops the program and image assembled so far, keeping the labels and the
+    // next address. Line mode calls this once the sinks have the code, so its
+    // memory use doesn't grow with the input. Objects, maps and --verify need
+    // the whole program and can't be used after this
+    inline void release() {
+        detail::program.clear();
+        detail::image.clear();
+        detail::image_base = detail::image_size;
     }
 
     inline void init(std::ostream&& t_stream) {
         detail::output.reset(&t_stream);
     }
 
+    // Labels to export from objects
+    inline void set_globals(const std::unordered_set <std::string>& names) {
+        detail::globals = names;
+    }
+
+    inline void add_sink(std::unique_ptr <sink::base> s) {
+        detail::sinks.push_back(std::move(s));
+    }
+
     inline void release_stream() {
+        for (auto& s : detail::sinks) s->finish();
+
+        detail::sinks.clear();
+
         if (!output_to_stdout) {
             detail::output.release()->clear();
         }
@@ -1,4 +1,5 @@
 #pragma once
 
 static inline bool output_to_stdout = false,
-                   input_from_stdin = false; 
\ No newline at end of file
+                   input_from_stdin = false,
+                   output_object = false; 
\ No newline at end of file
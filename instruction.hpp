@@ -22,25 +22,38 @@ namespace risc64 {
         no_operand                  = 0b11100
     };
 
+    // Every field has a default, so instructions can be built during constant evaluation
     struct operand {
-        uint64_t        const_value;
-        size_t          position;
-        register_type   reg_type;
-        size_t          reg_num;
-        operand_type    type;
+        uint64_t        const_value = 0;
+        size_t          position = 0;
+        register_type   reg_type = register_type::gpr;
+        size_t          reg_num = 0;
+        operand_type    type = operand_type::r;
+
+        // Name of the symbol this constant refers to, empty for literals
+        std::string     symbol;
+
+        // Source offset of the operand's token, see source::locate
+        uint32_t        offset = 0;
     };
 
     struct mnemonic {
         std::string     id;
-        operand_size    size;
-        operand_sign    sign;
-        condition       cond;
+        operand_size    size = operand_size::w;
+        operand_sign    sign = operand_sign::u;
+        condition       cond = condition::a;
     };
 
     struct instruction {
         typedef std::vector<operand> operand_array_t;
         mnemonic        m;
-        encoding_class  ec;
+        encoding_class  ec = encoding_class::no_operand;
         operand_array_t operands;
+
+        // Non-empty for label pseudo-instructions, which emit no code
+        std::string     label;
+
+        // Source offset of the mnemonic or label
+        uint32_t        offset = 0;
     };
 }
\ No newline at end of file
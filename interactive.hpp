@@ -0,0 +1,125 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+#include "global.hpp"
+#include "lexer.hpp"
+#include "preprocessor.hpp"
+#include "parser.hpp"
+#include "emitter.hpp"
+#include "trace.hpp"
+#include "log.hpp"
+
+/*
+    Line mode
+
+    Every statement is lexed, preprocessed, parsed, encoded and flushed as
+    soon as its ';' is read, so the assembler can run as a coprocess. Labels,
+    .equ names and macros carry over between statements, but must be defined
+    before they're used. A macro definition is handled once its .endm is
+    read. A statement with an error is reported and skipped.
+*/
+
+namespace interactive {
+    namespace detail {
+        typedef std::chrono::steady_clock clock;
+
+        // Time from reading a statement's ';' to flushing its code, in microseconds
+        uint64_t statements = 0,
+                 total_us = 0,
+                 max_us = 0;
+
+        // Lexes the next statement into s, returns false at the end of the input
+        bool lex_one(std::vector <lexer::token>& s) {
+            int t = 0;
+
+            s.clear();
+
+            while ((t != lexer::k_semicolon) && (t != lexer::k_eof)) {
+                t = lexer::get_next_token();
+
+                if (lexer::error_out) {
+                    lexer::skip_statement();
+                    s.clear();
+                    continue;
+                }
+
+                if (t) s.push_back({t, lexer::detail::data, lexer::detail::token_offset});
+            }
+
+            return t != lexer::k_eof;
+        }
+
+        inline bool starts_with_directive(const std::vector <lexer::token>& s, const char* name) {
+            return s.size() && ((s[0].id == lexer::k_directive) || (s[0].id == lexer::k_symbol)) && (s[0].data == name);
+        }
+
+        // Lexes the next statement into lexer::output, returns false at the end of the input.
+        // A macro definition is read up to its .endm, so it's preprocessed as a whole
+        bool lex_statement() {
+            std::vector <lexer::token> s;
+
+            lexer::output.clear();
+
+            if (!lex_one(s)) return false;
+
+            for (lexer::token& t : s) lexer::output.put(t);
+
+            if (starts_with_directive(s, "macro")) {
+                do {
+                    if (!lex_one(s)) return false;
+
+                    for (lexer::token& t : s) lexer::output.put(t);
+                } while (!starts_with_directive(s, "endm"));
+            }
+
+            // The parser expects the token stream to be terminated
+            lexer::output.put({lexer::k_eof});
+
+            return true;
+        }
+    }
+
+    // from is the path of the input, .import paths are relative to it
+    int run(const std::string& from = "") {
+        using namespace detail;
+
+        preprocessor pp;
+
+        parser::init();
+
+        while (lex_statement()) {
+            clock::time_point start = clock::now();
+
+            trace::scope s("interactive::statement");
+
+            if (!(pp.process_imports(from) && pp.process())) continue;
+
+            parser::output.clear();
+
+            if (!parser::parse()) continue;
+
+            if (!emitter::assemble()) continue;
+
+            emitter::detail::stream().flush();
+
+            // The sinks have the code, only the labels need to be kept
+            emitter::release();
+
+            uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start).count();
+
+            statements++;
+            total_us += us;
+            max_us = std::max(max_us, us);
+        }
+
+        if (statements) {
+            _log(info, "%s: %llu statement(s), %llu us average, %llu us max", __FUNCTION__,
+                 (unsigned long long)statements, (unsigned long long)(total_us / statements), (unsigned long long)max_us);
+        }
+
+        return 1;
+    }
+}
\ No newline at end of file
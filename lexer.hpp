@@ -1,5 +1,6 @@
 #pragma once
 
+#include <string_view>
 #include <optional>
 #include <istream>
 #include <ostream>
@@ -7,17 +8,23 @@
 #include <memory>
 #include <vector>
 
+#include "source.hpp"
+#include "trace.hpp"
 #include "log.hpp"
 
+// Lexer state is per-thread, so imported files can be lexed in parallel
 namespace lexer {
-    bool error_out = false;
+    thread_local bool error_out = false;
     
     struct token {
         int id = 0;
         std::string data = "";
 
-        token() = default;
-        token(int id, std::string data = "") : id(id), data(data) {}
+        // Offset of the token's first character, see source.hpp
+        uint32_t offset = 0;
+
+        constexpr token() = default;
+        constexpr token(int id, std::string data = "", uint32_t offset = 0) : id(id), data(data), offset(offset) {}
     };
 
     enum tokens {
@@ -26,10 +33,23 @@ namespace lexer {
         k_register    = 2,
         k_number      = 3,
         k_semicolon   = 4,
-        k_eof         = 5
+        k_eof         = 5,
+        k_label       = 6,
+        k_symbol      = 7,
+        k_directive   = 8,
+        k_string      = 9
     };
 
     namespace detail {
+        // Character classes that can be used in constant expressions, and don't depend on the locale
+        constexpr bool is_space(char c)  { return (c == ' ') || ((c >= '\t') && (c <= '\r')); }
+        constexpr bool is_digit(char c)  { return (c >= '0') && (c <= '9'); }
+        constexpr bool is_xdigit(char c) { return is_digit(c) || ((c >= 'a') && (c <= 'f')) || ((c >= 'A') && (c <= 'F')); }
+        constexpr bool is_alpha(char c)  { return ((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z')); }
+        constexpr bool is_alnum(char c)  { return is_alpha(c) || is_digit(c); }
+        constexpr bool is_name(char c)   { return is_alnum(c) || (c == '_'); }
+        constexpr bool is_bit(char c)    { return (c == '0') || (c == '1'); }
+
         enum class stream_order {
             normal,
             reverse
@@ -66,20 +86,34 @@ namespace lexer {
                 if (policy == stream_order::normal) index++;
                 this->push_back(value);
             }
+
+            inline void clear() {
+                std::vector<T>::clear();
+                index = 0;
+            }
         };
 
 
         // Pointer to an arbitrary input stream
-        std::unique_ptr <std::istream> input;
+        thread_local std::unique_ptr <std::istream> input;
         
         // Contains what's been just lexed
-        std::string data;
+        thread_local std::string data;
 
         // Last character that was 'get' from the input stream
-        char current_char = ' ';
+        thread_local char current_char = ' ';
+
+        // Offset given to the first character of the input, and the number of characters read from it
+        thread_local uint32_t base = 0, position = 0;
+
+        // Offset of the first character of the token being lexed
+        thread_local uint32_t token_offset = 0;
+
+        // Location of current_char, for diagnostics
+        inline std::string here() { return source::locate(base + position - 1); }
 
         // This function extracts the next character in the input
-        inline int get_next_char(size_t count = 1) { while (--count) { input->get(); } return input->get(); }
+        inline int get_next_char(size_t count = 1) { position += count; while (--count) { input->get(); } return input->get(); }
 
         inline void advance(size_t count = 1) { current_char = get_next_char(count); }
         inline void append() { data += current_char; }
@@ -88,15 +122,16 @@ namespace lexer {
         inline int peek_next_char() { return input->peek(); }
 
         // This function skips whitespace characters until a non-whitespace character is found
-        inline void ignore_whitespace() { while (std::isspace(current_char)) { current_char = get_next_char(); } }
+        inline void ignore_whitespace() { while (is_space(current_char)) { current_char = get_next_char(); } }
 
-        // [[:alpha:]]+
+        // [[:alpha:]_][[:alnum:]_]*
+        // Also lexes the names passed to directives
         std::optional <int> lex_instruction() {
-            if (!(std::isalpha(current_char))) {
+            if (!(is_alpha(current_char) || (current_char == '_'))) {
                 return {};
             }
 
-            while (std::isalpha(current_char)) append_advance();
+            while (is_alnum(current_char) || (current_char == '_')) append_advance();
             
             return tokens::k_instruction;
         }
@@ -107,8 +142,8 @@ namespace lexer {
                 return {};
             }
 
-            if (!std::isalpha(peek_next_char())) {
-                _log(error, "%s: Expected register-type after '%%'", __FUNCTION__);
+            if (!is_alpha(peek_next_char())) {
+                _log(error, "%s: %s: Expected register-type after '%%'", here().c_str(), __FUNCTION__);
                 error_out = true;
 
                 return {};
@@ -118,11 +153,11 @@ namespace lexer {
             advance();
 
             // Lex register type
-            while (std::isalpha(current_char)) append_advance();
+            while (is_alpha(current_char)) append_advance();
 
             // The register number must immediately follow the register type
-            if (!std::isdigit(current_char)) {
-                _log(error, "%s: Expected register-number after register-type", __FUNCTION__);
+            if (!is_digit(current_char)) {
+                _log(error, "%s: %s: Expected register-number after register-type", here().c_str(), __FUNCTION__);
                 error_out = true;
 
                 return {};
@@ -130,14 +165,14 @@ namespace lexer {
             }
 
             // Lex register number
-            while (std::isdigit(current_char)) append_advance();
+            while (is_digit(current_char)) append_advance();
 
             // A register operand must be followed by either a ',' (keep parsing operands), or a ';' (single operand)
             // There may be whitespace between the register and either ',' or ';'
-            if (std::isspace(current_char)) { ignore_whitespace(); }
+            if (is_space(current_char)) { ignore_whitespace(); }
 
             if (!((current_char == ',') || (current_char == ';'))) {
-                _log(error, "%s: Expected separator after register-number", __FUNCTION__);
+                _log(error, "%s: %s: Expected separator after register-number", here().c_str(), __FUNCTION__);
                 error_out = true;
 
                 return {};
@@ -168,22 +203,22 @@ namespace lexer {
                 current_char = get_next_char();
             }
             
-            if (std::isdigit(current_char)) {
+            if (is_digit(current_char)) {
                 char d = input->peek();
                 switch (d) {
                     case 'x': is_hex = true; break;
                     case 'b': is_bin = true; break;
                     default: {
-                        if (std::isdigit(d)) {
-                            while (std::isdigit(current_char)) append_advance();
+                        if (is_digit(d)) {
+                            while (is_digit(current_char)) append_advance();
                             return k_number;
                         }
 
-                        if (d == ';' || d == ',' || std::isspace(d)) {
+                        if (d == ';' || d == ',' || is_space(d)) {
                             append_advance();
                             return k_number;
                         } else {
-                            _log(error, "%s: Unexpected character '%c' after '#'", __FUNCTION__, d);
+                            _log(error, "%s: %s: Unexpected character '%c' after '#'", here().c_str(), __FUNCTION__, d);
                             error_out = true;
 
                             return {};
@@ -195,14 +230,14 @@ namespace lexer {
                     data += "0x";
                     current_char = get_next_char(2);
                     
-                    if (!std::isxdigit(current_char)) {
-                        _log(error, "%s: Expected a hex value after '0x'", __FUNCTION__);
+                    if (!is_xdigit(current_char)) {
+                        _log(error, "%s: %s: Expected a hex value after '0x'", here().c_str(), __FUNCTION__);
                         error_out = true;
 
                         return {};
                     }
 
-                    while (std::isxdigit(current_char)) { append_advance(); }
+                    while (is_xdigit(current_char)) { append_advance(); }
 
                     return k_number;
                 }
@@ -221,7 +256,7 @@ namespace lexer {
                     current_char = get_next_char(2);
 
                     if (!((current_char == '0') || (current_char == '1'))) {
-                        _log(error, "%s: Expected a binary value after '0b'", __FUNCTION__);
+                        _log(error, "%s: %s: Expected a binary value after '0b'", here().c_str(), __FUNCTION__);
                         error_out = true;
                         
                         return {};
@@ -246,6 +281,83 @@ namespace lexer {
             return {};
         }
 
+        // \.[[:alpha:]_][[:alnum:]_]*:
+        // \.[[:alpha:]_][[:alnum:]_]*[;,]
+        // \.[[:alpha:]_][[:alnum:]_]*[[:space:]]
+        std::optional <int> lex_symbol() {
+            if (!(current_char == '.')) {
+                return {};
+            }
+
+            if (!(is_alpha(peek_next_char()) || (peek_next_char() == '_'))) {
+                _log(error, "%s: %s: Expected a name after '.'", here().c_str(), __FUNCTION__);
+                error_out = true;
+
+                return {};
+            }
+
+            // Ignore '.'
+            advance();
+
+            while (is_alnum(current_char) || (current_char == '_')) append_advance();
+
+            // A name followed by ':' defines a label
+            if (current_char == ':') {
+                advance();
+
+                return k_label;
+            }
+
+            // A name followed by whitespace and anything but a separator is a directive
+            if (is_space(current_char)) {
+                ignore_whitespace();
+
+                if (!((current_char == ',') || (current_char == ';'))) return k_directive;
+            }
+
+            // Otherwise it's a reference, and must be followed by a separator like any other operand
+            if (!((current_char == ',') || (current_char == ';'))) {
+                _log(error, "%s: %s: Expected separator after symbol name", here().c_str(), __FUNCTION__);
+                error_out = true;
+
+                return {};
+            }
+
+            return k_symbol;
+        }
+
+        // "[^"\n]*"[;,]
+        std::optional <int> lex_string() {
+            if (!(current_char == '"')) {
+                return {};
+            }
+
+            // Ignore '"'
+            advance();
+
+            while ((current_char != '"') && (current_char != '\n') && !input->eof()) append_advance();
+
+            if (current_char != '"') {
+                _log(error, "%s: %s: Unterminated string", here().c_str(), __FUNCTION__);
+                error_out = true;
+
+                return {};
+            }
+
+            advance();
+
+            if (is_space(current_char)) { ignore_whitespace(); }
+
+            if (!((current_char == ',') || (current_char == ';'))) {
+                _log(error, "%s: %s: Expected separator after string", here().c_str(), __FUNCTION__);
+                error_out = true;
+
+                return {};
+            }
+
+            return k_string;
+        }
+
 #define INIT_OPT_HANDLER std::optional <int> t;
 #define HANDLE_OPT(k) t = lex_##k(); if (t) return t.value();
 
@@ -267,16 +379,21 @@ namespace lexer {
         ignore_whitespace();
 
         data = "";
+        token_offset = base + position - 1;
 
         INIT_OPT_HANDLER
 
         if (current_char == ';') {
             data += current_char;
-            current_char = get_next_char();
+
+            // Don't read past the end of the statement, the next character may not have been written yet
+            current_char = ' ';
             return k_semicolon;
         }
 
         HANDLE_OPT(instruction);
+        HANDLE_OPT(symbol);
+        HANDLE_OPT(string);
         HANDLE_OPT(operand);
 
         return tokens::k_unknown;
@@ -285,16 +402,119 @@ namespace lexer {
 #undef INIT_OPT_HANDLER
 #undef HANDLE_OPT
 
+    // Lexes text into out without the stream state above, so it can run in a constant expression.
+    // Only instructions, registers, numbers, labels and symbol references are accepted, and ','
+    // is skipped like get_next_token does. Separators are required where the lex_ functions above
+    // require them. Offsets are relative to the start of text.
+    // Returns false at the first character that doesn't start one of those, or a missing separator
+    constexpr bool scan(std::string_view text, std::vector <token>& out) {
+        using namespace detail;
+
+        size_t p = 0;
+
+        auto take = [&](bool (*is)(char)) {
+            size_t start = p;
+            while ((p < text.size()) && is(text[p])) p++;
+            return std::string(text.substr(start, p - start));
+        };
+
+        // Registers and symbol references, after any whitespace
+        auto separated = [&]() {
+            size_t q = p;
+            while ((q < text.size()) && is_space(text[q])) q++;
+            return (q < text.size()) && ((text[q] == ',') || (text[q] == ';'));
+        };
+
+        while (true) {
+            while ((p < text.size()) && (is_space(text[p]) || (text[p] == ','))) p++;
+
+            if (p >= text.size()) break;
+
+            uint32_t offset = p;
+            char c = text[p];
+
+            if (c == ';') {
+                p++;
+                out.push_back(token(k_semicolon, ";", offset));
+            } else if (is_alpha(c) || (c == '_')) {
+                out.push_back(token(k_instruction, take(is_name), offset));
+            } else if (c == '%') {
+                p++;
+
+                std::string type = take(is_alpha), number = take(is_digit);
+
+                if (type.empty() || number.empty() || !separated()) return false;
+
+                out.push_back(token(k_register, type + number, offset));
+            } else if (c == '#') {
+                std::string data;
+
+                if ((++p < text.size()) && ((text[p] == '-') || (text[p] == '+'))) {
+                    if (text[p] == '-') data += '-';
+                    p++;
+                }
+
+                // parser::detail::parse_number reads 0x and 0b prefixes
+                if (text.substr(p).starts_with("0x") || text.substr(p).starts_with("0b")) {
+                    data += text.substr(p, 2);
+                    p += 2;
+                }
+
+                std::string digits = take(data.ends_with("0x") ? is_xdigit :
+                                          data.ends_with("0b") ? is_bit : is_digit);
+
+                if (digits.empty()) return false;
+
+                // A single decimal digit must be followed by a separator or whitespace, see lex_number
+                if ((data.empty() || (data == "-")) && (digits.size() == 1) &&
+                    !((p < text.size()) && (is_space(text[p]) || (text[p] == ',') || (text[p] == ';')))) return false;
+
+                out.push_back(token(k_number, data + digits, offset));
+            } else if (c == '.') {
+                p++;
+
+                if (!((p < text.size()) && (is_alpha(text[p]) || (text[p] == '_')))) return false;
+
+                std::string name = take(is_name);
+
+                if ((p < text.size()) && (text[p] == ':')) {
+                    p++;
+                    out.push_back(token(k_label, name, offset));
+                } else {
+                    // Followed by anything else it would be a directive
+                    if (!separated()) return false;
+
+                    out.push_back(token(k_symbol, name, offset));
+                }
+            } else {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
     // Output stream
-    detail::stream<token> output;
+    thread_local detail::stream<token> output;
 
-    inline void init(std::istream&& t_stream) {
+    // base is the offset given to the first character of the stream, see source.hpp
+    inline void init(std::istream&& t_stream, uint32_t t_base = 0) {
         using namespace detail;
         input.reset(&t_stream);
+        base = t_base;
+        position = 1;
         current_char = input->get();
         output.set_policy(detail::stream_order::reverse);
     }
 
+    // Discards the input up to and including the next ';', used to recover from errors
+    inline void skip_statement() {
+        using namespace detail;
+        while ((current_char != ';') && !input->eof()) current_char = get_next_char();
+        current_char = ' ';
+        error_out = false;
+    }
+
     inline void release_stream() {
         using namespace detail;
         input.release()->clear();
@@ -302,11 +522,13 @@ namespace lexer {
 
 
     int lex() {
+        trace::scope s("lexer::lex");
+
         int t = 0;
         while (t != k_eof) {
             t = get_next_token();
             if (error_out) return 0;
-            if (t) { output.put({t, detail::data}); }
+            if (t) { output.put({t, detail::data, detail::token_offset}); }
         }
         return 1;
     }
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <unordered_map>
+#include <algorithm>
+#include <fstream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "parallel.hpp"
+#include "object.hpp"
+#include "log.hpp"
+
+/*
+    Linker
+
+    Merges relocatable objects into a single flat image:
+        1. Objects are read in parallel
+        2. Sections with the same name are laid out back to back, in the
+           order the objects were given, and sections in the order they're
+           first seen
+        3. Defined global symbols are entered into a global hash index, local
+           labels never leave their object
+        4. Relocations are applied in parallel, one object per task. Every
+           object only patches its own sections, so tasks never overlap
+*/
+
+namespace linker {
+    namespace detail {
+        std::vector <std::string>   inputs;
+        std::vector <object::file>  objects;
+
+        // Names of the output sections, in layout order
+        std::vector <std::string>   sections;
+
+        // Address of every (object, section) pair, indexed like objects[n].sections
+        std::vector <std::vector <uint64_t>> bases;
+
+        // Global symbol index
+        std::unordered_map <std::string, uint64_t> symbols;
+
+        std::vector <uint8_t> image;
+
+        bool read_objects() {
+            std::vector <char> ok(inputs.size(), 0);
+
+            objects.resize(inputs.size());
+
+            parallel::parallel_for(inputs.size(), [&](size_t n) {
+                std::ifstream f(inputs[n], std::ios::binary);
+                ok[n] = f.good() && object::read(f, objects[n]);
+            });
+
+            for (size_t n = 0; n < inputs.size(); n++) {
+                if (!ok[n]) {
+                    _log(error, "%s: Couldn't read object \"%s\"", __FUNCTION__, inputs[n].c_str());
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        void layout() {
+            for (object::file& f : objects) {
+                for (object::section& s : f.sections) {
+                    if (std::find(sections.begin(), sections.end(), s.name) == sections.end()) {
+                        sections.push_back(s.name);
+                    }
+                }
+            }
+
+            uint64_t address = 0;
+
+            bases.resize(objects.size());
+
+            for (size_t n = 0; n < objects.size(); n++) bases[n].resize(objects[n].sections.size());
+
+            for (std::string& name : sections) {
+                for (size_t n = 0; n < objects.size(); n++) {
+                    for (size_t s = 0; s < objects[n].sections.size(); s++) {
+                        if (objects[n].sections[s].name != name) continue;
+
+                        bases[n][s] = address;
+                        address += objects[n].sections[s].data.size();
+                    }
+                }
+            }
+
+            image.resize(address);
+
+            for (size_t n = 0; n < objects.size(); n++) {
+                for (size_t s = 0; s < objects[n].sections.size(); s++) {
+                    std::vector <uint8_t>& data = objects[n].sections[s].data;
+                    std::copy(data.begin(), data.end(), image.begin() + bases[n][s]);
+                }
+            }
+        }
+
+        bool index_symbols() {
+            for (size_t n = 0; n < objects.size(); n++) {
+                for (object::symbol& s : objects[n].symbols) {
+                    if (!(s.defined && s.global)) continue;
+
+                    if (s.section >= bases[n].size()) {
+                        _log(error, "%s: Symbol \"%s\" in \"%s\" refers to a missing section", __FUNCTION__, s.name.c_str(), inputs[n].c_str());
+                        return false;
+                    }
+
+                    if (!symbols.insert({s.name, bases[n][s.section] + s.value}).second) {
+                        _log(error, "%s: Multiple definitions of symbol \"%s\"", __FUNCTION__, s.name.c_str());
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+
+        bool relocate() {
+            // First error of every object, logged after the workers are done
+            std::vector <std::string> errors(objects.size());
+
+            parallel::parallel_for(objects.size(), [&](size_t n) {
+                object::file& f = objects[n];
+
+                for (object::relocation& r : f.relocations) {
+                    const std::string& name = (r.kind == object::to_symbol) ? f.symbols[r.target].name : f.sections[r.target].name;
+
+                    uint64_t size = f.sections[r.section].data.size();
+
+                    // Written so a huge offset can't wrap around and pass
+                    if ((r.offset > size) || (r.length > (size - r.offset))) {
+                        errors[n] = "Relocation against \"" + name + "\" is out of bounds";
+                        return;
+                    }
+
+                    uint64_t value;
+
+                    if (r.kind == object::to_section) {
+                        value = bases[n][r.target];
+                    } else {
+                        auto v = symbols.find(name);
+
+                        if (v == symbols.end()) {
+                            errors[n] = "Unresolved symbol \"" + name + "\"";
+                            return;
+                        }
+
+                        value = v->second;
+                    }
+
+                    object::detail::patch(&image[bases[n][r.section] + r.offset], r.length, r.shift, value + r.addend);
+                }
+            });
+
+            bool ok = true;
+
+            for (size_t n = 0; n < objects.size(); n++) {
+                if (errors[n].size()) {
+                    _log(error, "%s: %s in \"%s\"", __FUNCTION__, errors[n].c_str(), inputs[n].c_str());
+                    ok = false;
+                }
+            }
+            return ok;
+        }
+    }
+
+    void init(const std::vector <std::string>& inputs) {
+        detail::inputs = inputs;
+    }
+
+    int link(std::ostream& output) {
+        using namespace detail;
+
+        if (!read_objects()) return 0;
+
+        layout();
+
+        if (!index_symbols()) return 0;
+
+        if (!relocate()) return 0;
+
+        output.write((const char*)image.data(), image.size());
+
+        return 1;
+    }
+}
\ No newline at end of file
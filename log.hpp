@@ -8,7 +8,7 @@
 #include <memory>
 
 namespace log {
-    char buf[512];
+    thread_local char buf[512];
 
     std::ofstream file;
 
@@ -23,7 +23,8 @@ namespace log {
 
     template <class... Args> void log(const char* t, std::string fmt, Args... args) {
         sprintf(buf, fmt.c_str(), args...);
-        std::cout << t << "\u001b[0m risc64-a: " << buf << std::endl;
+        // Diagnostics go to stderr, stdout may be carrying the assembled code
+        std::clog << t << "\u001b[0m risc64-a: " << buf << std::endl;
 
         if (file.is_open()) {
             std::string tstr(t), l = tstr.substr(tstr.find_last_of('['), 3) + " ";
@@ -0,0 +1,226 @@
+#pragma once
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/*
+    Relocatable object format
+
+    All integers are little-endian, strings are a u32 length followed by
+    their characters.
+
+    header:
+        "R64O" u16 version
+        u32 section count, u32 symbol count, u32 relocation count
+
+    section:
+        string name, u64 size, u8[size] data
+
+    symbol:
+        string name, u32 section, u64 value, u8 defined, u8 global
+
+    relocation:
+        u32 section, u64 offset, u8 kind, u32 target, u8 shift, u8 length, i64 addend
+
+    A relocation patches the <length> bytes at <offset> in <section>, storing
+    (target address + addend) at bit <shift> of the little-endian word they
+    form. Bits below <shift> (the instruction's opcode and registers) are
+    preserved. The target is a symbol, looked up among the global symbols of
+    every object, or for a section relocation, a section of the same object.
+
+    Only global symbols are visible to other objects. References to labels
+    an object defines itself are section relocations, so local labels need
+    no symbol at all.
+*/
+
+namespace object {
+    constexpr char     magic[4] = { 'R', '6', '4', 'O' };
+    constexpr uint16_t version  = 2;
+
+    struct section {
+        std::string             name;
+        std::vector <uint8_t>   data;
+    };
+
+    struct symbol {
+        std::string     name;
+        uint32_t        section = 0;
+        uint64_t        value = 0;
+        bool            defined = false;
+        bool            global = false;
+    };
+
+    enum relocation_kind : uint8_t {
+        to_symbol  = 0,
+        to_section = 1
+    };
+
+    struct relocation {
+        uint32_t        section = 0;
+        uint64_t        offset = 0;
+        uint8_t         kind = to_symbol;
+        uint32_t        target = 0;
+        uint8_t         shift = 0;
+        uint8_t         length = 0;
+        int64_t         addend = 0;
+    };
+
+    struct file {
+        std::vector <section>       sections;
+        std::vector <symbol>        symbols;
+        std::vector <relocation>    relocations;
+
+        // Returns the index of the section called name, creating it if needed
+        uint32_t get_section(const std::string& name) {
+            for (uint32_t i = 0; i < sections.size(); i++) {
+                if (sections[i].name == name) return i;
+            }
+            sections.push_back({name, {}});
+            return sections.size() - 1;
+        }
+    };
+
+    namespace detail {
+        template <class T> void write_int(std::ostream& o, T value) {
+            for (size_t i = 0; i < sizeof(T); i++) {
+                o.put((uint8_t)((uint64_t)value >> (i*8)));
+            }
+        }
+
+        template <class T> bool read_int(std::istream& in, T& value) {
+            uint64_t v = 0;
+            for (size_t i = 0; i < sizeof(T); i++) {
+                int c = in.get();
+                if (c == EOF) return false;
+                v |= (uint64_t)(uint8_t)c << (i*8);
+            }
+            value = (T)v;
+            return true;
+        }
+
+        void write_string(std::ostream& o, const std::string& s) {
+            write_int<uint32_t>(o, s.size());
+            o.write(s.data(), s.size());
+        }
+
+        // Bytes left in a seekable stream, sizes read from a file are checked against it before
+        // anything is allocated for them
+        uint64_t remaining(std::istream& in) {
+            std::istream::pos_type p = in.tellg();
+
+            if (p == std::istream::pos_type(-1)) return ~0ull;
+
+            in.seekg(0, std::ios::end);
+            std::istream::pos_type end = in.tellg();
+            in.seekg(p);
+
+            return (end < p) ? 0 : (uint64_t)(end - p);
+        }
+
+        bool read_string(std::istream& in, std::string& s) {
+            uint32_t size;
+            if (!read_int(in, size) || (size > remaining(in))) return false;
+            s.resize(size);
+            return (bool)in.read(s.data(), size);
+        }
+
+        // Patches value into the <length> bytes at p, starting at bit <shift>
+        inline void patch(uint8_t* p, uint8_t length, uint8_t shift, uint64_t value) {
+            uint64_t word = 0,
+                     mask = (length >= 8) ? ~0ull : ((1ull << (length*8)) - 1);
+
+            mask &= ~((1ull << shift) - 1);
+
+            for (size_t i = 0; i < length; i++) word |= (uint64_t)p[i] << (i*8);
+
+            word = (word & ~mask) | ((value << shift) & mask);
+
+            for (size_t i = 0; i < length; i++) p[i] = (uint8_t)(word >> (i*8));
+        }
+    }
+
+    void write(std::ostream& o, const file& f) {
+        using namespace detail;
+
+        o.write(magic, sizeof(magic));
+        write_int(o, version);
+
+        write_int<uint32_t>(o, f.sections.size());
+        write_int<uint32_t>(o, f.symbols.size());
+        write_int<uint32_t>(o, f.relocations.size());
+
+        for (const section& s : f.sections) {
+            write_string(o, s.name);
+            write_int<uint64_t>(o, s.data.size());
+            o.write((const char*)s.data.data(), s.data.size());
+        }
+
+        for (const symbol& s : f.symbols) {
+            write_string(o, s.name);
+            write_int(o, s.section);
+            write_int(o, s.value);
+            write_int<uint8_t>(o, s.defined);
+            write_int<uint8_t>(o, s.global);
+        }
+
+        for (const relocation& r : f.relocations) {
+            write_int(o, r.section);
+            write_int(o, r.offset);
+            write_int(o, r.kind);
+            write_int(o, r.target);
+            write_int(o, r.shift);
+            write_int(o, r.length);
+            write_int(o, r.addend);
+        }
+    }
+
+    // Returns false if the stream isn't a well-formed object
+    bool read(std::istream& in, file& f) {
+        using namespace detail;
+
+        char m[sizeof(magic)];
+        uint16_t v;
+        uint32_t sections, symbols, relocations;
+
+        if (!in.read(m, sizeof(m)) || !std::equal(m, m + sizeof(m), magic)) return false;
+        if (!read_int(in, v) || (v != version)) return false;
+
+        if (!(read_int(in, sections) && read_int(in, symbols) && read_int(in, relocations))) return false;
+
+        // Every entry takes at least a byte
+        uint64_t left = remaining(in);
+
+        if ((sections > left) || (symbols > left) || (relocations > left)) return false;
+
+        f.sections.resize(sections);
+        f.symbols.resize(symbols);
+        f.relocations.resize(relocations);
+
+        for (section& s : f.sections) {
+            uint64_t size;
+            if (!(read_string(in, s.name) && read_int(in, size)) || (size > remaining(in))) return false;
+            s.data.resize(size);
+            if (!in.read((char*)s.data.data(), size)) return false;
+        }
+
+        for (symbol& s : f.symbols) {
+            uint8_t defined, global;
+            if (!(read_string(in, s.name) && read_int(in, s.section) &&
+                  read_int(in, s.value) && read_int(in, defined) && read_int(in, global))) return false;
+            s.defined = defined;
+            s.global = global;
+        }
+
+        for (relocation& r : f.relocations) {
+            if (!(read_int(in, r.section) && read_int(in, r.offset) && read_int(in, r.kind) && read_int(in, r.target) &&
+                  read_int(in, r.shift) && read_int(in, r.length) && read_int(in, r.addend))) return false;
+            if ((r.section >= sections) || (r.length > 8) || (r.shift >= 64)) return false;
+            if ((r.kind == to_symbol) ? (r.target >= symbols) : ((r.kind != to_section) || (r.target >= sections))) return false;
+        }
+
+        return true;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,247 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <string>
+
+#include "instruction.hpp"
+#include "parser.hpp"
+#include "source.hpp"
+#include "trace.hpp"
+#include "log.hpp"
+
+/*
+    Peephole optimizer
+
+    Runs between parser::parse and emitter::assemble, sliding a small window
+    over the parsed instruction stream and rewriting it through a table of
+    rules. Passes are repeated until no rule fires.
+
+    Label pseudo-instructions never match a rule, so no window spans a branch
+    target. Symbolic constants are resolved after this pass, but literal
+    addresses can't be: a rewrite moves every instruction after it. Any
+    literal constant may end up used as an address, even through the ALU
+    and a register jump, so no rule is run on code before the highest
+    literal that's within the program. The skipped code is reported with a
+    warning.
+*/
+
+namespace optimizer {
+    namespace detail {
+        using namespace risc64;
+
+        typedef std::vector<instruction> buffer_t;
+
+        struct rule {
+            const char* name;
+
+            // Number of instructions this rule looks at
+            size_t      window;
+
+            // w points to the first instruction of the window
+            bool        (*match)(instruction* w);
+
+            // Appends the replacement for the window to out
+            void        (*rewrite)(instruction* w, buffer_t& out);
+
+            size_t      fired = 0;
+        };
+
+        inline bool is(instruction& i, const char* id) {
+            return i.m.id == id;
+        }
+
+        inline bool same_register(operand& a, operand& b) {
+            return (a.type == operand_type::r) && (b.type == operand_type::r) &&
+                   (a.reg_type == b.reg_type) && (a.reg_num == b.reg_num);
+        }
+
+        inline bool is_const(operand& o, uint64_t value) {
+            return (o.type == operand_type::c) && o.symbol.empty() && (o.const_value == value);
+        }
+
+        inline bool same_form(instruction& a, instruction& b) {
+            return (a.m.size == b.m.size) && (a.m.sign == b.m.sign) && (a.m.cond == b.m.cond);
+        }
+
+        // Largest constant that fits in an operand of size s
+        inline uint64_t const_limit(operand_size s) {
+            switch (s) {
+                case operand_size::b: return 0xffull;
+                case operand_size::w: return 0xffffull;
+                case operand_size::d: return 0xffffffffull;
+                case operand_size::q: return ~0ull;
+            }
+            return 0;
+        }
+
+        inline bool is_sp_adjust(instruction& i) {
+            return (is(i, "addsp") || is(i, "subsp")) &&
+                   (i.ec == encoding_class::s_const) && (i.m.cond == condition::a) &&
+                   i.operands[0].symbol.empty();
+        }
+
+        // Signed stack pointer displacement of an addsp/subsp instruction
+        inline int64_t sp_delta(instruction& i) {
+            int64_t v = (int64_t)i.operands[0].const_value;
+            return is(i, "addsp") ? v : -v;
+        }
+
+        void remove(instruction*, buffer_t&) {}
+
+        std::vector <rule> rules = {
+            // push %rX; pop %rX; -> (nothing)
+            { "push-pop", 2,
+                [](instruction* w) {
+                    return is(w[0], "push") && is(w[1], "pop") &&
+                           (w[0].ec == encoding_class::s_register) && (w[1].ec == encoding_class::s_register) &&
+                           same_form(w[0], w[1]) && (w[0].m.cond == condition::a) &&
+                           same_register(w[0].operands[0], w[1].operands[0]);
+                },
+                remove
+            },
+
+            // add %rX, #0; / sub %rX, #0; -> (nothing)
+            { "add-zero", 1,
+                [](instruction* w) {
+                    return (is(w[0], "add") || is(w[0], "sub")) &&
+                           (w[0].ec == encoding_class::d_register_single_const) &&
+                           is_const(w[0].operands[1], 0);
+                },
+                remove
+            },
+
+            // add %rX, %rX, #0; / sub %rX, %rX, #0; -> (nothing)
+            { "add-zero-self", 1,
+                [](instruction* w) {
+                    return (is(w[0], "add") || is(w[0], "sub")) &&
+                           (w[0].ec == encoding_class::t_register_single_const) &&
+                           same_register(w[0].operands[0], w[0].operands[1]) &&
+                           is_const(w[0].operands[2], 0);
+                },
+                remove
+            },
+
+            // addsp/subsp #a; addsp/subsp #b; -> addsp/subsp #(a +/- b);
+            { "fold-sp", 2,
+                [](instruction* w) {
+                    if (!(is_sp_adjust(w[0]) && is_sp_adjust(w[1]) && same_form(w[0], w[1]))) return false;
+
+                    int64_t d = sp_delta(w[0]) + sp_delta(w[1]);
+                    uint64_t m = (uint64_t)(d < 0 ? -d : d);
+
+                    return m <= const_limit(w[0].m.size);
+                },
+                [](instruction* w, buffer_t& out) {
+                    int64_t d = sp_delta(w[0]) + sp_delta(w[1]);
+
+                    if (!d) return;
+
+                    instruction i = w[0];
+                    i.m.id = (d > 0) ? "addsp" : "subsp";
+                    i.operands[0].const_value = (uint64_t)(d > 0 ? d : -d);
+                    out.push_back(i);
+                }
+            },
+
+            // j .L; .L: -> .L:
+            { "jump-next-label", 2,
+                [](instruction* w) {
+                    return is(w[0], "j") && (w[0].ec == encoding_class::s_const) &&
+                           w[1].label.size() && (w[0].operands[0].symbol == w[1].label);
+                },
+                [](instruction* w, buffer_t& out) {
+                    out.push_back(w[1]);
+                }
+            }
+        };
+
+        // Returns the highest literal constant that's an address within the program, 0 if there's none,
+        // and sets at to the instruction it's in. The code before it mustn't move
+        uint64_t find_literal_address(const buffer_t& in, const instruction*& at) {
+            uint64_t size = 0, highest = 0;
+
+            for (const instruction& i : in) size += parser::detail::parse_instruction_length(i);
+
+            at = nullptr;
+
+            for (const instruction& i : in) {
+                for (const operand& o : i.operands) {
+                    if ((o.type != operand_type::c) || o.symbol.size()) continue;
+
+                    if ((o.const_value <= size) && (o.const_value > highest)) {
+                        highest = o.const_value;
+                        at = &i;
+                    }
+                }
+            }
+
+            return highest;
+        }
+
+        // Runs a single pass of the rule table over in, returns true if any rule fired.
+        // No window starting before the address fixed is rewritten
+        bool run_pass(buffer_t& in, buffer_t& out, uint64_t fixed) {
+            bool changed = false;
+            uint64_t address = 0;
+
+            out.clear();
+
+            for (size_t p = 0; p < in.size();) {
+                bool fired = false;
+
+                for (rule& r : rules) {
+                    if ((p + r.window) > in.size()) continue;
+
+                    if (address < fixed) break;
+
+                    if (r.match(&in[p])) {
+                        for (size_t k = 0; k < r.window; k++) {
+                            address += parser::detail::parse_instruction_length(in[p+k]);
+                        }
+
+                        r.rewrite(&in[p], out);
+                        r.fired++;
+                        p += r.window;
+                        fired = changed = true;
+                        break;
+                    }
+                }
+
+                if (!fired) {
+                    address += parser::detail::parse_instruction_length(in[p]);
+                    out.push_back(in[p++]);
+                }
+            }
+
+            return changed;
+        }
+    }
+
+    void optimize() {
+        trace::scope s("optimizer::optimize");
+
+        detail::buffer_t in, out;
+
+        while (!parser::output.eof()) in.push_back(parser::output.get());
+
+        const detail::instruction* literal;
+
+        uint64_t fixed = detail::find_literal_address(in, literal);
+
+        if (fixed) {
+            _log(warning, "%s: %s: Literal constant in \"%s\" may be an address, code before 0x%llx isn't optimized",
+                 source::locate(literal->offset).c_str(), __FUNCTION__, print_source(*literal).c_str(), (unsigned long long)fixed);
+        }
+
+        while (detail::run_pass(in, out, fixed)) std::swap(in, out);
+
+        parser::output.clear();
+
+        for (detail::instruction& i : in) parser::output.put(i);
+
+        for (detail::rule& r : detail::rules) {
+            if (r.fired) _log(info, "%s: Rule \"%s\" fired %zu time(s)", __FUNCTION__, r.name, r.fired);
+        }
+    }
+}
\ No newline at end of file
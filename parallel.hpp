@@ -0,0 +1,36 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <string>
+
+#include "trace.hpp"
+
+namespace parallel {
+    // Number of workers to use for the given number of tasks
+    inline size_t thread_count(size_t tasks) {
+        size_t n = std::thread::hardware_concurrency();
+        return std::max<size_t>(1, std::min<size_t>(n ? n : 1, tasks));
+    }
+
+    // Runs task(n) for every n in [0, count) on a pool of threads
+    template <class F> void parallel_for(size_t count, F task) {
+        std::atomic <size_t> next = 0;
+        std::vector <std::thread> pool;
+
+        for (size_t t = 0; t < thread_count(count); t++) {
+            pool.emplace_back([&]() {
+                trace::scope s("parallel::worker");
+
+                for (size_t n = next++; n < count; n = next++) {
+                    trace::scope t("parallel::task", [&] { return std::to_string(n); });
+                    task(n);
+                }
+            });
+        }
+
+        for (std::thread& t : pool) t.join();
+    }
+}
\ No newline at end of file
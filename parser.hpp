@@ -5,79 +5,187 @@
 
 #include "instruction.hpp"
 #include "lexer.hpp"
+#include "source.hpp"
+#include "trace.hpp"
+#include "log.hpp"
 
+#include <string_view>
 #include <iostream>
-#include <regex>
+#include <cstdio>
+#include <cstdint>
 
 namespace parser {
     namespace detail {
         using namespace risc64;
 
-        void parse_instruction_mnemonic(std::string m, mnemonic& i) {
-            std::smatch sm;
-            std::regex r("(addsp|subsp|halt|call|push|test|pop|ret|cmp|abs|add|sub|mul|div|lsp|slc|src|rlc|rrc|not|mod|and|xor|scl|fj|or|lr|sl|sr|rl|rr|i|d|l|s|b|j)(hw|dw|qw|b|w|d|q)?(nv|nz|nc|z|c|n|p)?([us]?)");
-            if (std::regex_match(m, sm, r)) {
-                i.id = sm[1];
-                i.size = operand_size::w;
-                i.sign = operand_sign::u;
-                i.cond = condition::a;
-
-                if (sm[2].length()) {
-                    if (sm[2] == "q" || sm[2] == "qw") i.size = operand_size::q;
-                    if (sm[2] == "d" || sm[2] == "dw") i.size = operand_size::d;
-                    if (sm[2] == "b" || sm[2] == "hw") i.size = operand_size::b;
-                }
+        // The parts a mnemonic is spelled from, in the order they're tried
+        constexpr std::string_view mnemonic_ids[] = {
+            "addsp", "subsp", "halt", "call", "push", "test", "pop", "ret", "cmp", "abs", "add", "sub", "mul",
+            "div", "lsp", "slc", "src", "rlc", "rrc", "not", "mod", "and", "xor", "scl", "fj", "or", "lr",
+            "sl", "sr", "rl", "rr", "i", "d", "l", "s", "b", "j"
+        };
 
-                if (sm[3].length()) {
-                    if (sm[3] == "p" ) i.cond = condition::p;
-                    if (sm[3] == "n" ) i.cond = condition::n;
-                    if (sm[3] == "z" ) i.cond = condition::z;
-                    if (sm[3] == "c" ) i.cond = condition::c;
-                    if (sm[3] == "nz") i.cond = condition::nz;
-                    if (sm[3] == "nc") i.cond = condition::nc;
-                }
+        constexpr std::string_view mnemonic_sizes[] = { "hw", "dw", "qw", "b", "w", "d", "q", "" };
+        constexpr operand_size     size_values[]    = { operand_size::b, operand_size::d, operand_size::q, operand_size::b,
+                                                        operand_size::w, operand_size::d, operand_size::q, operand_size::w };
+
+        // "nv" is accepted, but isn't encoded as never
+        constexpr std::string_view mnemonic_conds[] = { "nv", "nz", "nc", "z", "c", "n", "p", "" };
+        constexpr condition        cond_values[]    = { condition::a, condition::nz, condition::nc, condition::z,
+                                                        condition::c, condition::n, condition::p, condition::a };
+
+        constexpr std::string_view mnemonic_signs[] = { "u", "s", "" };
+        constexpr operand_sign     sign_values[]    = { operand_sign::u, operand_sign::s, operand_sign::u };
+
+        // <id>[size][cond][sign], the first combination of parts that spells all of m is taken.
+        // Returns false if m isn't a known mnemonic
+        constexpr bool parse_instruction_mnemonic(std::string_view m, mnemonic& i) {
+            for (std::string_view id : mnemonic_ids) {
+                if (!m.starts_with(id)) continue;
+
+                std::string_view a = m.substr(id.size());
+
+                for (size_t sz = 0; sz < std::size(mnemonic_sizes); sz++) {
+                    if (!a.starts_with(mnemonic_sizes[sz])) continue;
+
+                    std::string_view b = a.substr(mnemonic_sizes[sz].size());
+
+                    for (size_t cd = 0; cd < std::size(mnemonic_conds); cd++) {
+                        if (!b.starts_with(mnemonic_conds[cd])) continue;
+
+                        std::string_view c = b.substr(mnemonic_conds[cd].size());
 
-                if (sm[4].length()) {
-                    if (sm[4] == "s") i.sign = operand_sign::s;
+                        for (size_t sg = 0; sg < std::size(mnemonic_signs); sg++) {
+                            if (c != mnemonic_signs[sg]) continue;
+
+                            i.id = id;
+                            i.size = size_values[sz];
+                            i.cond = cond_values[cd];
+                            i.sign = sign_values[sg];
+
+                            return true;
+                        }
+                    }
                 }
             }
+
+            return false;
         }
 
-        void parse_operands(instruction::operand_array_t& operands) {
-            lexer::token t = lexer::output.get();
+        // Value of a number token: [+-]?(0x<hex>|0b<binary>|0<octal>|<decimal>), negative values wrap.
+        // Returns false if the magnitude doesn't fit in 64 bits
+        constexpr bool parse_number(std::string_view data, uint64_t& value) {
+            bool negative = false;
+            uint64_t base = 10;
 
-            size_t c = 0;
-            operand o;
+            value = 0;
 
-            while (t.id != lexer::k_semicolon) {
-                std::string& data = t.data;
+            if (data.size() && ((data[0] == '-') || (data[0] == '+'))) {
+                negative = (data[0] == '-');
+                data.remove_prefix(1);
+            }
+
+            if (data.starts_with("0x") || data.starts_with("0X")) {
+                base = 16; data.remove_prefix(2);
+            } else if (data.starts_with("0b")) {
+                base = 2; data.remove_prefix(2);
+            } else if (data.starts_with("0")) {
+                base = 8;
+            }
+
+            for (char ch : data) {
+                uint64_t d = ((ch >= '0') && (ch <= '9')) ? (ch - '0') :
+                             ((ch >= 'a') && (ch <= 'f')) ? (ch - 'a' + 10) :
+                             ((ch >= 'A') && (ch <= 'F')) ? (ch - 'A' + 10) : 16;
+
+                if (d >= base) break;
+
+                if (value > ((UINT64_MAX - d) / base)) return false;
+
+                value = value * base + d;
+            }
+
+            if (negative) value = -value;
+
+            return true;
+        }
+
+        // Fills o from a register, number or symbol token. Returns false for anything else, an unknown register type
+        // or a number out of range
+        constexpr bool parse_operand(const lexer::token& t, operand& o) {
+            std::string_view data = t.data;
 
-                // If the operand is a constant
-                if (std::isdigit(data[0]) || data[0] == '-' || data[0] == '+') {
-                    o.const_value = std::stoull(data, nullptr, 0);
-                    o.position = c++;
+            o.offset = t.offset;
+            o.symbol.clear();
+
+            switch (t.id) {
+                // A symbol's value is resolved by the emitter
+                case lexer::k_symbol: {
+                    o.const_value = 0;
+                    o.symbol = data;
                     o.type = operand_type::c;
-                    operands.push_back(o);
-                }
+                } return true;
+
+                case lexer::k_number: {
+                    if (!parse_number(data, o.const_value)) return false;
+                    o.type = operand_type::c;
+                } return true;
+
+                // <type><number>
+                case lexer::k_register: {
+                    size_t n = 0;
+
+                    while ((n < data.size()) && !((data[n] >= '0') && (data[n] <= '9'))) n++;
+
+                    std::string_view rt = data.substr(0, n);
 
-                // If the operand is a register
-                if (std::isalpha(data[0])) {
-                    std::string rt = "", rn = "";
-                    size_t i = 0;
-                    while (!std::isdigit(data[i])) { rt += data[i++]; }
-                    while ( std::isdigit(data[i])) { rn += data[i++]; }
                     if (rt == "r" || rt == "gpr") o.reg_type = register_type::gpr;
-                    if (rt == "f" || rt == "fpr") o.reg_type = register_type::fpr;
-                    o.reg_num = std::stoi(rn);
-                    o.position = c++;
+                    else if (rt == "f" || rt == "fpr") o.reg_type = register_type::fpr;
+                    else return false;
+
+                    o.reg_num = 0;
+                    for (char ch : data.substr(n)) o.reg_num = o.reg_num * 10 + (ch - '0');
                     o.type = operand_type::r;
-                    operands.push_back(o);
+                } return true;
+
+                default: return false;
+            }
+        }
+
+        // Reads the operands of i up to its ';'. Returns false on a malformed operand or a missing ';'
+        bool parse_operands(instruction& i) {
+            lexer::token t = lexer::output.get();
+
+            operand o;
+
+            while (t.id != lexer::k_semicolon) {
+                if (t.id == lexer::k_eof) {
+                    _log(error, "%s: %s: Expected ';'", source::locate(i.offset).c_str(), __FUNCTION__);
+                    return false;
                 }
+
+                if (!parse_operand(t, o)) {
+                    if (t.id == lexer::k_number) {
+                        _log(error, "%s: %s: Number out of range \"%s\"", source::locate(t.offset).c_str(), __FUNCTION__, t.data.c_str());
+                        return false;
+                    }
+
+                    _log(error, "%s: %s: Malformed operand \"%s\"", source::locate(t.offset).c_str(), __FUNCTION__, t.data.c_str());
+                    return false;
+                }
+
+                o.position = i.operands.size();
+                i.operands.push_back(o);
+
                 t = lexer::output.get();
             }
+
+            return true;
         }
 
-        constexpr size_t parse_instruction_length(instruction& i) {
+        constexpr size_t parse_instruction_length(const instruction& i) {
+            if (i.label.size()) return 0;
+
             switch (i.ec) {
                 case encoding_class::t_register_all: return 5;
                 case encoding_class::t_register_single_const:
@@ -108,10 +216,10 @@ namespace parser {
             }
         }
 
-        void parse_encoding_class(instruction& i) {
+        constexpr void parse_encoding_class(instruction& i) {
             bool has_const = false;
 
-            for (operand& o : i.operands) {
+            for (const operand& o : i.operands) {
                 if (o.type == operand_type::c) { has_const = true; break; }
             }
 
@@ -139,18 +247,41 @@ namespace parser {
         output.set_policy(lexer::detail::stream_order::reverse);
     }
 
-    void parse() {
+    // Returns 0 on the first malformed statement
+    int parse() {
+        trace::scope s("parser::parse");
+
         lexer::token t = lexer::output.get();
         while (!lexer::output.eof()) {
             if (t.id == lexer::k_instruction) {
                 detail::instruction i;
-                detail::parse_instruction_mnemonic(t.data, i.m);
-                detail::parse_operands(i.operands);
+                i.offset = t.offset;
+                if (!detail::parse_instruction_mnemonic(t.data, i.m)) {
+                    _log(error, "%s: %s: Unknown mnemonic \"%s\"", source::locate(t.offset).c_str(), __FUNCTION__, t.data.c_str());
+                    return 0;
+                }
+                if (!detail::parse_operands(i)) return 0;
                 detail::parse_encoding_class(i);
                 output.put(i);
             }
+            if (t.id == lexer::k_label) {
+                detail::instruction i;
+                i.label = t.data;
+                i.offset = t.offset;
+                output.put(i);
+            }
+            // The preprocessor consumes every directive it knows
+            if ((t.id == lexer::k_directive) || (t.id == lexer::k_symbol)) {
+                _log(error, "%s: %s: Unknown directive \".%s\"", source::locate(t.offset).c_str(), __FUNCTION__, t.data.c_str());
+                return 0;
+            }
+            if ((t.id == lexer::k_number) || (t.id == lexer::k_string) || (t.id == lexer::k_register)) {
+                _log(error, "%s: %s: Expected a mnemonic or a directive, got \"%s\"", source::locate(t.offset).c_str(), __FUNCTION__, t.data.c_str());
+                return 0;
+            }
             t = lexer::output.get();
         }
+        return 1;
     }
 }
 
@@ -178,4 +309,40 @@ const std::string print_instruction(parser::detail::instruction& i) {
     }
     ss << "}})";
     return ss.str();
+}
+
+// Formats i as source that assembles back to the same encoding
+const std::string print_source(const parser::detail::instruction& i) {
+    using namespace risc64;
+
+    static const char* sizes[] = { "b", "", "d", "q" },
+                     * conds[] = { "z", "c", "n", "", "nv", "p", "nc", "nz" };
+
+    if (i.label.size()) return "." + i.label + ":";
+
+    std::string s = i.m.id;
+
+    if (i.ec != encoding_class::no_operand) s += sizes[(int)i.m.size];
+
+    s += conds[(int)i.m.cond];
+
+    if ((i.ec != encoding_class::no_operand) && (i.m.sign == operand_sign::s)) s += "s";
+
+    for (size_t n = 0; n < i.operands.size(); n++) {
+        const operand& o = i.operands[n];
+
+        s += n ? ", " : " ";
+
+        if (o.type == operand_type::r) {
+            s += ((o.reg_type == register_type::fpr) ? "%f" : "%r") + std::to_string(o.reg_num);
+        } else if (o.symbol.size()) {
+            s += "." + o.symbol;
+        } else {
+            char buf[24];
+            snprintf(buf, sizeof(buf), "#0x%llx", (unsigned long long)o.const_value);
+            s += buf;
+        }
+    }
+
+    return s + ";";
 }
\ No newline at end of file
@@ -1,11 +1,40 @@
+#pragma once
+
 #include <unordered_map>
+#include <unordered_set>
+#include <filesystem>
+#include <algorithm>
+#include <cstdint>
 #include <iostream>
+#include <fstream>
 #include <memory>
+#include <string>
+#include <vector>
+
+#include "lexer.hpp"
+#include "parser.hpp"
+#include "source.hpp"
+#include "parallel.hpp"
+#include "trace.hpp"
+#include "log.hpp"
 
 /*
+    .import directive: .import "<FILE>"
+        Inserts the code and names of FILE, relative to the importing file.
+        Every file is inserted once, before the first file that imports it
+
+    .macro directive: .macro <NAME> [PARAM, ...]; <BODY> .endm;
+        Defines a macro, invoked like an instruction: <NAME> [ARG, ...];
+        References to .<PARAM> in BODY are replaced with the matching ARG
+        Labels defined in BODY are local to every expansion: .<LABEL> becomes
+        <LABEL>@<N>, a name that can't be written in source
+
     .equ directive: .equ <NAME>, <VALUE>
         All instances of <NAME> will be replaced with <VALUE>
 
+    .global directive: .global <NAME>
+        Exports the label <NAME> from an object, other labels are local to it
+
     .label/.l/.<>: directive: .label <NAME>/.l <NAME>/.<NAME>:
         Create a name with a value equal to the current working address
 
@@ -34,10 +63,591 @@ public:
         point   = -1,
         colon   = -2,
         import  = -3,
-        base    = -4
+        base    = -4,
+        param   = -5
     };
+
+    typedef std::unordered_map <std::string, std::string> names_t;
+
+    // Rewrites lexer::output in place, returns 0 on error
+    int process() {
+        std::vector <lexer::token> in, out, expanded;
+
+        while (!lexer::output.eof()) in.push_back(lexer::output.get());
+
+        {
+            trace::scope s("preprocessor::define_macros");
+            if (!define_macros(in, out)) return 0;
+        }
+
+        {
+            trace::scope s("preprocessor::expand_macros");
+            if (!expand_macros(out, expanded, 0)) return 0;
+        }
+
+        out.clear();
+
+        {
+            trace::scope s("preprocessor::define_names");
+            if (!define_names(expanded, out)) return 0;
+        }
+
+        {
+            trace::scope s("preprocessor::define_globals");
+            if (!define_globals(out)) return 0;
+        }
+
+        {
+            trace::scope s("preprocessor::substitute_names");
+            substitute_names(out);
+        }
+
+        lexer::output.clear();
+
+        for (lexer::token& t : out) lexer::output.put(t);
+
+        return 1;
+    }
+
+    const names_t& get_names() const {
+        return names;
+    }
+
+    // Labels named by .global
+    const std::unordered_set <std::string>& get_globals() const {
+        return globals;
+    }
+
+    // Replaces the imports in lexer::output with the files they refer to, relative to from ("" for the working directory).
+    // Independent files are loaded in parallel, returns 0 on error or on an import cycle
+    int process_imports(const std::string& from = "") {
+        namespace fs = std::filesystem;
+
+        trace::scope s("preprocessor::process_imports");
+
+        std::string root = from.size() ? fs::weakly_canonical(from).string() : "<stdin>";
+        fs::path root_dir = from.size() ? fs::path(root).parent_path() : fs::current_path();
+
+        std::vector <lexer::token> tokens;
+
+        while (!lexer::output.eof()) tokens.push_back(lexer::output.get());
+
+        std::vector <lexer::token> root_deps;
+
+        if (!scan_imports(tokens, root_dir, root_deps)) return 0;
+
+        // Load every file that isn't cached yet, a wave at a time
+        std::vector <lexer::token> wave = missing(root_deps);
+
+        while (wave.size()) {
+            trace::scope w("preprocessor::load_wave", [&] { return std::to_string(wave.size()) + " file(s)"; });
+
+            std::vector <unit> loaded(wave.size());
+
+            parallel::parallel_for(wave.size(), [&](size_t n) {
+                loaded[n].ok = load(wave[n].data, loaded[n]);
+            });
+
+            std::vector <lexer::token> next;
+
+            for (size_t n = 0; n < wave.size(); n++) {
+                if (!loaded[n].ok) {
+                    _log(error, "%s: %s: Couldn't import \"%s\"", source::locate(wave[n].offset).c_str(), __FUNCTION__, wave[n].data.c_str());
+                    return 0;
+                }
+
+                for (lexer::token& d : loaded[n].deps) {
+                    if (!units.count(d.data) && !contains(wave, d.data) && !contains(next, d.data)) next.push_back(d);
+                }
+
+                imports.push_back(wave[n].data);
+                units[wave[n].data] = std::move(loaded[n]);
+            }
+
+            wave = std::move(next);
+        }
+
+        // Splice in dependencies first, every file only once
+        std::vector <lexer::token> out;
+        std::vector <std::string> path = { root };
+
+        {
+            trace::scope t("preprocessor::splice");
+
+            for (lexer::token& d : root_deps) {
+                if (!splice(d, path, out)) return 0;
+            }
+        }
+
+        for (lexer::token& t : tokens) {
+            if (t.id != import) out.push_back(t);
+        }
+
+        lexer::output.clear();
+
+        for (lexer::token& t : out) lexer::output.put(t);
+
+        return 1;
+    }
+
+    // Every imported file, in the order they were loaded
+    const std::vector <std::string>& get_imports() const {
+        return imports;
+    }
+
+    // Writes a make rule making target depend on source and everything it imports
+    void write_dependencies(std::ostream& o, const std::string& target, const std::string& source) const {
+        o << target << ": " << source;
+
+        for (const std::string& i : imports) o << " \\\n  " << i;
+
+        o << std::endl;
+
+        // Empty rules, so make doesn't fail when an imported file is removed
+        for (const std::string& i : imports) o << std::endl << i << ":" << std::endl;
+    }
+
 private:
-    std::unique_ptr <std::istream> stream;
-    
-    std::unordered_map <std::string, std::string> names;
+    names_t names;
+
+    std::unordered_set <std::string> globals;
+
+    // Collects and removes every .global declaration
+    int define_globals(std::vector <lexer::token>& tokens) {
+        size_t o = 0;
+
+        for (size_t i = 0; i < tokens.size(); i++) {
+            if (!((tokens[i].id == lexer::k_directive) && (tokens[i].data == "global"))) {
+                if (o != i) tokens[o] = std::move(tokens[i]);
+                o++;
+                continue;
+            }
+
+            // .global <NAME>;
+            if (((i + 2) >= tokens.size()) ||
+                (tokens[i+1].id != lexer::k_instruction) ||
+                (tokens[i+2].id != lexer::k_semicolon)) {
+                _log(error, "%s: %s: Expected .global <NAME>;", source::locate(tokens[i].offset).c_str(), __FUNCTION__);
+                return 0;
+            }
+
+            globals.insert(tokens[i+1].data);
+
+            i += 2;
+        }
+
+        tokens.resize(o);
+
+        return 1;
+    }
+
+    // Macro bodies are stored as (token id, string pool index) pairs, parameter
+    // references as (param, parameter index). Expanded tokens keep the offset
+    // they have in the definition
+    struct body_token {
+        int32_t     id;
+        uint32_t    data;
+        uint32_t    offset;
+    };
+
+    struct macro {
+        size_t                      params;
+        std::vector <body_token>    body;
+    };
+
+    std::unordered_map <std::string, macro> macros;
+
+    std::vector <std::string> pool;
+    std::unordered_map <std::string, uint32_t> pool_index;
+
+    // Expansions are memoized with the labels local to them still marked as <LABEL>@<MACRO>,
+    // and given a unique suffix every time they're copied out
+    struct expansion {
+        std::vector <lexer::token>  tokens;
+
+        // Positions of the marked labels and references to them in tokens
+        std::vector <uint32_t>      locals;
+    };
+
+    // Finished expansions, by macro name and arguments
+    std::unordered_map <std::string, expansion> expansions;
+
+    // Number of expansions copied out that have local labels
+    size_t instances = 0;
+
+    static constexpr size_t max_expansion_depth = 64;
+
+    uint32_t intern(const std::string& s) {
+        auto p = pool_index.find(s);
+
+        if (p != pool_index.end()) return p->second;
+
+        pool.push_back(s);
+
+        return pool_index[s] = pool.size() - 1;
+    }
+
+    static bool is_endm(const lexer::token& t) {
+        return ((t.id == lexer::k_directive) || (t.id == lexer::k_symbol)) && (t.data == "endm");
+    }
+
+    // Collects every .macro definition, copying all other tokens to out
+    int define_macros(std::vector <lexer::token>& in, std::vector <lexer::token>& out) {
+        for (size_t i = 0; i < in.size(); i++) {
+            if (!((in[i].id == lexer::k_directive) && (in[i].data == "macro"))) {
+                out.push_back(in[i]);
+                continue;
+            }
+
+            // .macro <NAME> [PARAM, ...];
+            if (((i + 1) >= in.size()) || (in[i+1].id != lexer::k_instruction)) {
+                _log(error, "%s: %s: Expected .macro <NAME> [PARAM, ...];", source::locate(in[i].offset).c_str(), __FUNCTION__);
+                return 0;
+            }
+
+            const lexer::token& definition = in[i];
+            std::string name = in[i+1].data;
+            std::vector <std::string> params;
+
+            for (i += 2; (i < in.size()) && (in[i].id == lexer::k_instruction); i++) params.push_back(in[i].data);
+
+            if ((i >= in.size()) || (in[i].id != lexer::k_semicolon)) {
+                _log(error, "%s: %s: Expected ';' after the parameters of macro \"%s\"", source::locate(definition.offset).c_str(), __FUNCTION__, name.c_str());
+                return 0;
+            }
+
+            macro m;
+            m.params = params.size();
+
+            // Labels defined in the body are local to it
+            std::unordered_set <std::string> locals;
+
+            bool statement_start = true;
+
+            for (size_t j = i + 1; (j < in.size()) && !(statement_start && is_endm(in[j])); j++) {
+                if (in[j].id == lexer::k_label) locals.insert(in[j].data);
+                statement_start = (in[j].id == lexer::k_semicolon) || (in[j].id == lexer::k_label);
+            }
+
+            statement_start = true;
+
+            for (i++; (i < in.size()) && !(statement_start && is_endm(in[i])); i++) {
+                lexer::token& t = in[i];
+
+                if ((t.id == lexer::k_directive) && (t.data == "macro")) {
+                    _log(error, "%s: %s: Macro \"%s\" contains a .macro", source::locate(t.offset).c_str(), __FUNCTION__, name.c_str());
+                    return 0;
+                }
+
+                auto p = std::find(params.begin(), params.end(), t.data);
+
+                if ((t.id == lexer::k_symbol) && (p != params.end())) {
+                    m.body.push_back({param, (uint32_t)(p - params.begin()), t.offset});
+                } else if (((t.id == lexer::k_label) || (t.id == lexer::k_symbol)) && locals.count(t.data)) {
+                    m.body.push_back({t.id, intern(t.data + "@" + name), t.offset});
+                } else {
+                    m.body.push_back({t.id, intern(t.data), t.offset});
+                }
+
+                statement_start = (t.id == lexer::k_semicolon) || (t.id == lexer::k_label);
+            }
+
+            if (i >= in.size()) {
+                _log(error, "%s: %s: Missing .endm for macro \"%s\"", source::locate(definition.offset).c_str(), __FUNCTION__, name.c_str());
+                return 0;
+            }
+
+            // Skip the ';' after .endm
+            if (((i + 1) < in.size()) && (in[i+1].id == lexer::k_semicolon)) i++;
+
+            if (!macros.insert({name, std::move(m)}).second) {
+                _log(error, "%s: %s: Redefinition of macro \"%s\"", source::locate(definition.offset).c_str(), __FUNCTION__, name.c_str());
+                return 0;
+            }
+        }
+
+        return 1;
+    }
+
+    // Copies in to out, replacing every macro invocation with its expansion. caller is the macro whose body in is
+    int expand_macros(const std::vector <lexer::token>& in, std::vector <lexer::token>& out, size_t depth, const std::string& caller = "") {
+        bool statement_start = true;
+
+        for (size_t i = 0; i < in.size(); i++) {
+            const lexer::token& t = in[i];
+
+            if (!(statement_start && (t.id == lexer::k_instruction) && macros.count(t.data))) {
+                out.push_back(t);
+                statement_start = (t.id == lexer::k_semicolon) || (t.id == lexer::k_label);
+                continue;
+            }
+
+            // <NAME> [ARG, ...];
+            std::vector <lexer::token> args;
+
+            for (i++; (i < in.size()) && (in[i].id != lexer::k_semicolon); i++) args.push_back(in[i]);
+
+            if (i >= in.size()) {
+                _log(error, "%s: %s: Expected ';' after invocation of macro \"%s\"", source::locate(t.offset).c_str(), __FUNCTION__, t.data.c_str());
+                return 0;
+            }
+
+            if (!expand(t, args, out, depth, caller)) return 0;
+        }
+
+        return 1;
+    }
+
+    // Appends the expansion of the macro invoked by call with args to out. Below the top level, its
+    // local labels stay marked as local to caller, so they're unique in every expansion of caller too
+    int expand(const lexer::token& call, const std::vector <lexer::token>& args, std::vector <lexer::token>& out,
+               size_t depth, const std::string& caller) {
+        const std::string& name = call.data;
+        std::string key = name;
+
+        for (const lexer::token& a : args) {
+            key += '\0';
+            key += (char)a.id;
+            key += a.data;
+        }
+
+        auto e = expansions.find(key);
+
+        if (e == expansions.end()) {
+            macro& m = macros[name];
+
+            if (args.size() != m.params) {
+                _log(error, "%s: %s: Macro \"%s\" takes %zu argument(s), %zu given", source::locate(call.offset).c_str(), __FUNCTION__, name.c_str(), m.params, args.size());
+                return 0;
+            }
+
+            if (depth >= max_expansion_depth) {
+                _log(error, "%s: %s: Expansion of macro \"%s\" is too deep, it may be recursive", source::locate(call.offset).c_str(), __FUNCTION__, name.c_str());
+                return 0;
+            }
+
+            std::vector <lexer::token> body, expanded;
+
+            body.reserve(m.body.size());
+
+            for (body_token& b : m.body) {
+                if (b.id == param) {
+                    body.push_back(args[b.data]);
+                } else {
+                    body.push_back(lexer::token(b.id, pool[b.data], b.offset));
+                }
+            }
+
+            // Bodies may invoke other macros
+            if (!expand_macros(body, expanded, depth + 1, name)) return 0;
+
+            expansion x;
+            std::string marker = "@" + name;
+
+            for (size_t n = 0; n < expanded.size(); n++) {
+                const lexer::token& t = expanded[n];
+
+                if (((t.id == lexer::k_label) || (t.id == lexer::k_symbol)) && t.data.ends_with(marker)) x.locals.push_back(n);
+            }
+
+            x.tokens = std::move(expanded);
+
+            e = expansions.insert({key, std::move(x)}).first;
+        }
+
+        size_t first = out.size();
+
+        out.insert(out.end(), e->second.tokens.begin(), e->second.tokens.end());
+
+        if (e->second.locals.size()) {
+            size_t marker = name.size() + 1;
+            std::string suffix = "@" + std::to_string(instances++) + (depth ? "@" + caller : "");
+
+            for (uint32_t n : e->second.locals) {
+                std::string& data = out[first + n].data;
+                data.replace(data.size() - marker, marker, suffix);
+            }
+        }
+
+        return 1;
+    }
+
+    struct unit {
+        std::vector <lexer::token>  tokens;
+        // Import tokens, holding the canonical path of every file this one imports
+        std::vector <lexer::token>  deps;
+        bool                        ok = false;
+    };
+
+    // Lexed imports, by canonical path
+    std::unordered_map <std::string, unit> units;
+
+    std::vector <std::string> imports;
+
+    // Imports already spliced into the output
+    std::unordered_set <std::string> included;
+
+    static bool contains(const std::vector <lexer::token>& deps, const std::string& path) {
+        return std::find_if(deps.begin(), deps.end(), [&](const lexer::token& d) { return d.data == path; }) != deps.end();
+    }
+
+    std::vector <lexer::token> missing(const std::vector <lexer::token>& deps) {
+        std::vector <lexer::token> m;
+
+        for (const lexer::token& d : deps) {
+            if (!units.count(d.data) && !contains(m, d.data)) m.push_back(d);
+        }
+
+        return m;
+    }
+
+    // Turns every .import "<FILE>"; into a single import token holding the canonical path of FILE
+    static int scan_imports(std::vector <lexer::token>& tokens, const std::filesystem::path& dir, std::vector <lexer::token>& deps) {
+        std::vector <lexer::token> out;
+
+        for (size_t i = 0; i < tokens.size(); i++) {
+            if (!((tokens[i].id == lexer::k_directive) && (tokens[i].data == "import"))) {
+                out.push_back(tokens[i]);
+                continue;
+            }
+
+            if (((i + 2) >= tokens.size()) ||
+                (tokens[i+1].id != lexer::k_string) ||
+                (tokens[i+2].id != lexer::k_semicolon)) {
+                _log(error, "%s: %s: Expected .import \"<FILE>\";", source::locate(tokens[i].offset).c_str(), __FUNCTION__);
+                return 0;
+            }
+
+            std::string path = std::filesystem::weakly_canonical(dir / tokens[i+1].data).string();
+
+            deps.push_back(lexer::token(import, path, tokens[i].offset));
+            out.push_back(deps.back());
+
+            i += 2;
+        }
+
+        tokens = std::move(out);
+
+        return 1;
+    }
+
+    // Reads and lexes the file at path on the calling thread
+    static bool load(const std::string& path, unit& u) {
+        trace::scope s("preprocessor::load", [&] { return path; });
+
+        std::ifstream file(path);
+
+        if (!file.good()) return false;
+
+        uint32_t base = source::add(path, file);
+        source::istream text(source::text(base));
+
+        lexer::error_out = false;
+        lexer::output.clear();
+        lexer::init(std::move(text), base);
+
+        bool ok = lexer::lex();
+
+        while (ok && !lexer::output.eof()) {
+            lexer::token& t = lexer::output.get();
+            if (t.id != lexer::k_eof) u.tokens.push_back(t);
+        }
+
+        lexer::release_stream();
+        lexer::output.clear();
+
+        return ok && scan_imports(u.tokens, std::filesystem::path(path).parent_path(), u.deps);
+    }
+
+    // Appends the file at path to out, after everything it imports. path holds the chain of imports being spliced
+    int splice(const lexer::token& dep, std::vector <std::string>& path, std::vector <lexer::token>& out) {
+        const std::string& file = dep.data;
+
+        if (std::find(path.begin(), path.end(), file) != path.end()) {
+            std::string cycle;
+            for (std::string& p : path) cycle += p + " -> ";
+            _log(error, "%s: %s: Import cycle: %s%s", source::locate(dep.offset).c_str(), __FUNCTION__, cycle.c_str(), file.c_str());
+            return 0;
+        }
+
+        if (included.count(file)) return 1;
+
+        unit& u = units[file];
+
+        path.push_back(file);
+
+        for (lexer::token& d : u.deps) {
+            if (!splice(d, path, out)) return 0;
+        }
+
+        path.pop_back();
+
+        included.insert(file);
+
+        for (lexer::token& t : u.tokens) {
+            if (t.id != import) out.push_back(t);
+        }
+
+        return 1;
+    }
+
+    // Collects every .equ definition, copying all other tokens to out
+    int define_names(std::vector <lexer::token>& in, std::vector <lexer::token>& out) {
+        for (size_t i = 0; i < in.size(); i++) {
+            if (!((in[i].id == lexer::k_directive) && (in[i].data == "equ"))) {
+                out.push_back(in[i]);
+                continue;
+            }
+
+            // .equ <NAME>, <VALUE>;
+            if (((i + 3) >= in.size()) ||
+                (in[i+1].id != lexer::k_instruction) ||
+                ((in[i+2].id != lexer::k_number) && (in[i+2].id != lexer::k_symbol)) ||
+                (in[i+3].id != lexer::k_semicolon)) {
+                _log(error, "%s: %s: Expected .equ <NAME>, <VALUE>;", source::locate(in[i].offset).c_str(), __FUNCTION__);
+                return 0;
+            }
+
+            std::string value = in[i+2].data;
+
+            // Values may refer to names defined before them
+            if (in[i+2].id == lexer::k_symbol) {
+                auto n = names.find(value);
+
+                if (n == names.end()) {
+                    _log(error, "%s: %s: Undefined name \"%s\" in .equ", source::locate(in[i+2].offset).c_str(), __FUNCTION__, value.c_str());
+                    return 0;
+                }
+
+                value = n->second;
+            } else {
+                uint64_t v;
+
+                if (!parser::detail::parse_number(value, v)) {
+                    _log(error, "%s: %s: Number out of range \"%s\" in .equ", source::locate(in[i+2].offset).c_str(), __FUNCTION__, value.c_str());
+                    return 0;
+                }
+            }
+
+            if (!names.insert({in[i+1].data, value}).second) {
+                _log(error, "%s: %s: Redefinition of \"%s\"", source::locate(in[i+1].offset).c_str(), __FUNCTION__, in[i+1].data.c_str());
+                return 0;
+            }
+
+            i += 3;
+        }
+
+        return 1;
+    }
+
+    // Replaces every reference to a name with its value, anything else is left for the emitter to resolve as a label
+    void substitute_names(std::vector <lexer::token>& tokens) {
+        for (lexer::token& t : tokens) {
+            if (t.id != lexer::k_symbol) continue;
+
+            auto n = names.find(t.data);
+
+            if (n != names.end()) t = lexer::token(lexer::k_number, n->second, t.offset);
+        }
+    }
 };
\ No newline at end of file
@@ -0,0 +1,256 @@
+#pragma once
+
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <array>
+
+#include "instruction.hpp"
+#include "parser.hpp"
+#include "emitter.hpp"
+#include "sink.hpp"
+#include "log.hpp"
+
+/*
+    Size and cost report
+
+    Every label starts a region that runs up to the next label, code before
+    the first label goes to <start>. For each region the report lists its
+    size, instruction count, estimated cycles and encoding class mix, one
+    region per line, largest first:
+
+        address bytes count cycles t_reg t_const d_reg d_const d_dconst s_reg s_const none name
+
+    Cycles are estimated from a per-mnemonic cost table keyed like the
+    emitter's id_table, which can be replaced from a file of
+    "<mnemonic> <cycles>" lines. A report from an earlier build can be
+    read back and compared against, every region that grew is warned about.
+*/
+
+namespace report {
+    namespace detail {
+        using namespace risc64;
+
+        // Estimated cycles per mnemonic, anything missing costs 1
+        std::unordered_map <std::string, uint32_t> costs = {
+        //    ALU binary:         ALU unary:          LSU:                BNJ:                SYS:
+            { "add"     , 1  }, { "not"     , 1  }, { "l"       , 3  }, { "b"       , 2  }, { "halt"    , 1  },
+            { "sub"     , 1  }, { "i"       , 1  }, { "s"       , 2  }, { "j"       , 2  },
+            { "rsub"    , 1  }, { "d"       , 1  }, { "lr"      , 3  }, { "call"    , 4  },
+            { "mul"     , 3  }, { "abs"     , 1  }, { "lsp"     , 1  }, { "ret"     , 4  },
+            { "div"     , 12 },                     { "push"    , 2  },
+            { "rdiv"    , 12 },                     { "pop"     , 3  },
+            { "mod"     , 12 },
+            { "and"     , 1  },
+            { "or"      , 1  },
+            { "xor"     , 1  },
+            { "sl"      , 1  },
+            { "sr"      , 1  },
+            { "cmp"     , 1  },
+            { "test"    , 1  },
+            { "addsp"   , 1  },
+            { "subsp"   , 1  },
+        };
+
+        // Column names of the encoding class mix, indexed by encoding class >> 2
+        const std::array <const char*, 8> classes = {
+            "t_reg", "t_const", "d_reg", "d_const", "d_dconst", "s_reg", "s_const", "none"
+        };
+
+        inline uint32_t cost(const std::string& id) {
+            auto c = costs.find(id);
+            return (c != costs.end()) ? c->second : 1;
+        }
+    }
+
+    struct region {
+        std::string                 name;
+        uint64_t                    address = 0,
+                                    bytes = 0,
+                                    count = 0,
+                                    cycles = 0;
+
+        // Instructions of every encoding class, indexed by encoding class >> 2
+        std::array <uint64_t, 8>    mix = {};
+    };
+
+    // Overrides entries of the cost table from a file of "<mnemonic> <cycles>" lines, '#' starts a comment.
+    // Returns 0 if the file can't be read or names a mnemonic the emitter doesn't know
+    int load_costs(const std::string& fn) {
+        std::ifstream file(fn);
+
+        if (!file.good()) {
+            _log(error, "%s: Couldn't open cost table \"%s\"", __FUNCTION__, fn.c_str());
+            return 0;
+        }
+
+        std::string line;
+
+        for (size_t n = 1; std::getline(file, line); n++) {
+            line = line.substr(0, line.find('#'));
+
+            std::istringstream ss(line);
+            std::string id;
+            uint32_t cycles;
+
+            if (!(ss >> id)) continue;
+
+            if (!(ss >> cycles)) {
+                _log(error, "%s: %s:%zu: Expected <mnemonic> <cycles>", __FUNCTION__, fn.c_str(), n);
+                return 0;
+            }
+
+            if (!emitter::detail::find_id(id)) {
+                _log(error, "%s: %s:%zu: Unknown mnemonic \"%s\"", __FUNCTION__, fn.c_str(), n, id.c_str());
+                return 0;
+            }
+
+            detail::costs[id] = cycles;
+        }
+
+        return 1;
+    }
+
+    void write(std::ostream& o, const std::vector <region>& regions) {
+        o << "# address          bytes    count   cycles";
+        for (const char* c : detail::classes) o << " " << c;
+        o << " name" << std::endl;
+
+        for (const region& r : regions) {
+            o << std::setfill('0') << std::setw(16) << std::hex << r.address << std::dec << std::setfill(' ')
+              << " " << std::setw(8) << r.bytes
+              << " " << std::setw(8) << r.count
+              << " " << std::setw(8) << r.cycles;
+
+            for (size_t c = 0; c < r.mix.size(); c++) o << " " << std::setw(strlen(detail::classes[c])) << r.mix[c];
+
+            o << " " << r.name << std::endl;
+        }
+    }
+
+    // Reads a report written by write, returns false if it can't be opened or is malformed
+    bool read(const std::string& fn, std::vector <region>& regions) {
+        std::ifstream file(fn);
+
+        if (!file.good()) return false;
+
+        std::string line;
+
+        while (std::getline(file, line)) {
+            if (line.empty() || (line[0] == '#')) continue;
+
+            std::istringstream ss(line);
+            region r;
+
+            ss >> std::hex >> r.address >> std::dec >> r.bytes >> r.count >> r.cycles;
+            for (uint64_t& m : r.mix) ss >> m;
+            ss >> r.name;
+
+            if (ss.fail()) return false;
+
+            regions.push_back(r);
+        }
+
+        return true;
+    }
+
+    // Logs how every region changed since the build old was reported from
+    void diff(const std::vector <region>& old, const std::vector <region>& regions) {
+        std::unordered_map <std::string, const region*> before;
+
+        for (const region& r : old) before[r.name] = &r;
+
+        int64_t bytes = 0, cycles = 0;
+
+        for (const region& r : regions) {
+            auto b = before.find(r.name);
+
+            if (b == before.end()) {
+                _log(info, "%s: \"%s\" is new, %llu byte(s), %llu cycle(s)", __FUNCTION__, r.name.c_str(),
+                     (unsigned long long)r.bytes, (unsigned long long)r.cycles);
+                bytes += r.bytes;
+                cycles += r.cycles;
+                continue;
+            }
+
+            int64_t db = (int64_t)r.bytes - (int64_t)b->second->bytes,
+                    dc = (int64_t)r.cycles - (int64_t)b->second->cycles;
+
+            if ((db > 0) || (dc > 0)) {
+                _log(warning, "%s: \"%s\" grew: %+lld byte(s), %+lld cycle(s)", __FUNCTION__, r.name.c_str(), (long long)db, (long long)dc);
+            } else if (db || dc) {
+                _log(info, "%s: \"%s\" shrank: %+lld byte(s), %+lld cycle(s)", __FUNCTION__, r.name.c_str(), (long long)db, (long long)dc);
+            }
+
+            bytes += db;
+            cycles += dc;
+
+            before.erase(b);
+        }
+
+        for (auto& [name, r] : before) {
+            _log(info, "%s: \"%s\" was removed, %llu byte(s), %llu cycle(s)", __FUNCTION__, name.c_str(),
+                 (unsigned long long)r->bytes, (unsigned long long)r->cycles);
+            bytes -= r->bytes;
+            cycles -= r->cycles;
+        }
+
+        _log(info, "%s: Total %+lld byte(s), %+lld cycle(s)", __FUNCTION__, (long long)bytes, (long long)cycles);
+    }
+
+    // Sink gathering the regions of the program, writes the report once assembly is done
+    class collector : public sink::base {
+        std::ofstream           o;
+        std::vector <region>    regions;
+        std::vector <region>    baseline;
+        bool                    compare;
+
+    public:
+        // Compares against baseline if compare is set
+        collector(const std::string& fn, std::vector <region> baseline = {}, bool compare = false) :
+            o(fn), baseline(std::move(baseline)), compare(compare) {
+            regions.push_back({"<start>"});
+        }
+
+        bool good() const { return o.good(); }
+
+        void label(uint64_t address, const std::string& name) override {
+            region r;
+            r.name = name;
+            r.address = address;
+            regions.push_back(r);
+        }
+
+        void put(uint64_t, const uint8_t*, size_t size, const parser::detail::instruction& i) override {
+            region& r = regions.back();
+
+            r.bytes += size;
+            r.count++;
+            r.cycles += detail::cost(i.m.id);
+            r.mix[(uint8_t)i.ec >> 2]++;
+        }
+
+        void finish() override {
+            std::vector <region> out;
+
+            for (region& r : regions) {
+                if (r.count) out.push_back(r);
+            }
+
+            std::stable_sort(out.begin(), out.end(), [](const region& a, const region& b) { return a.bytes > b.bytes; });
+
+            write(o, out);
+
+            o.flush();
+
+            if (compare) diff(baseline, out);
+        }
+    };
+}
\ No newline at end of file
@@ -6,10 +6,26 @@
 #include "log.hpp"
 
 #include "global.hpp"
+#include "source.hpp"
+#include "trace.hpp"
 
 #include "lexer.hpp"
+#include "preprocessor.hpp"
 #include "parser.hpp"
+#include "optimizer.hpp"
 #include "emitter.hpp"
+#include "symmap.hpp"
+#include "disassembler.hpp"
+#include "interactive.hpp"
+#include "report.hpp"
+#include "embed.hpp"
+
+// Keeps the compile-time assembler building, and its output in step with the runtime encoder
+static_assert(risc64::assemble<".l: subqs %r4, #-0x10; mulb %r1, %r2, #0b101; jnz .l; halt;">() ==
+              std::array <uint8_t, 19> { 0x63, 0x01, 0x27, 0xf0, 0xff, 0xff, 0xff,
+                                         0x23, 0x03, 0x08, 0xa2, 0x00,
+                                         0xd7, 0x01, 0x02, 0x00, 0x00,
+                                         0xfb, 0xfe });
 
 
 static inline void error_exit() {
@@ -19,7 +35,20 @@ static inline void error_exit() {
 
     if (emitter::detail::output) emitter::release_stream();
 
-    exit(EXIT_SUCCESS);
+    trace::finish();
+
+    exit(EXIT_FAILURE);
+}
+
+template <class T, class... Args> static void add_file_sink(const std::string& setting, Args&&... args) {
+    std::unique_ptr <T> s = std::make_unique<T>(cli::settings[setting], std::forward<Args>(args)...);
+
+    if (!s->good()) {
+        _log(error, "%s: Couldn't open %s file", __FUNCTION__, setting.c_str());
+        error_exit();
+    }
+
+    emitter::add_sink(std::move(s));
 }
 
 int main(int argc, const char* argv[]) {
@@ -27,19 +56,34 @@ int main(int argc, const char* argv[]) {
 
     cli::parse();
 
+    if (cli::is_defined("trace")) trace::init(cli::settings["trace"]);
+
     std::ofstream output_file;
     std::ifstream input_file;
 
+    // The input is read whole and registered with the source manager, so diagnostics can point into it
+    std::unique_ptr <source::istream> input_text;
+
     if (!cli::is_defined("input")) {
         if (std::cin.eof()) {
             _log(error, "%s: No input", __FUNCTION__);
             error_exit();
         }
-        lexer::init(std::move(std::cin));
+
+        if (cli::is_defined("interactive")) {
+            // Line mode can't wait for the end of the input
+            lexer::init(std::move(std::cin), source::stream_base);
+        } else {
+            uint32_t base = source::add("<stdin>", std::cin);
+            input_text = std::make_unique<source::istream>(source::text(base));
+            lexer::init(std::move(*input_text), base);
+        }
     } else {
         input_file.open(cli::settings["input"]);
         if (input_file.good()) {
-            lexer::init(std::move(input_file));
+            uint32_t base = source::add(cli::settings["input"], input_file);
+            input_text = std::make_unique<source::istream>(source::text(base));
+            lexer::init(std::move(*input_text), base);
         } else {
             _log(error, "%s: Couldn't open input file", __FUNCTION__);
             error_exit();
@@ -53,15 +97,100 @@ int main(int argc, const char* argv[]) {
         output_to_stdout = true;
     }
 
+    output_object = cli::is_defined("object");
+
+    // Objects are written whole by the emitter, everything else goes through sinks
+    if (!output_object) {
+        if (cli::is_defined("hex")) {
+            emitter::add_sink(std::make_unique<sink::hex>(emitter::detail::stream()));
+        } else {
+            emitter::add_sink(std::make_unique<sink::raw>(emitter::detail::stream()));
+        }
+    }
+
+    if (cli::is_defined("ihex"))    add_file_sink<sink::ihex>("ihex");
+    if (cli::is_defined("srec"))    add_file_sink<sink::srec>("srec");
+    if (cli::is_defined("listing")) add_file_sink<sink::listing>("listing");
+
+    if (cli::is_defined("report")) {
+        if (cli::is_defined("cost-table") && !report::load_costs(cli::settings["cost-table"])) error_exit();
+
+        std::vector <report::region> baseline;
+
+        if (cli::is_defined("report-diff") && !report::read(cli::settings["report-diff"], baseline)) {
+            _log(error, "%s: Couldn't read report \"%s\"", __FUNCTION__, cli::settings["report-diff"].c_str());
+            error_exit();
+        }
+
+        add_file_sink<report::collector>("report", std::move(baseline), cli::is_defined("report-diff"));
+    }
+
+    if (cli::is_defined("interactive")) {
+        if (output_object) {
+            _log(error, "%s: Objects can't be written in line mode", __FUNCTION__);
+            error_exit();
+        }
+
+        interactive::run(cli::is_defined("input") ? cli::settings["input"] : "");
+
+        lexer::release_stream();
+
+        emitter::release_stream();
+
+        if (!trace::finish()) error_exit();
+
+        return 0;
+    }
+
     if (!lexer::lex()) error_exit();
 
+    preprocessor pp;
+
+    if (!pp.process_imports(cli::is_defined("input") ? cli::settings["input"] : "")) error_exit();
+
+    if (!pp.process()) error_exit();
+
+    if (cli::is_defined("deps")) {
+        std::ofstream deps_file(cli::settings["deps"]);
+
+        pp.write_dependencies(deps_file,
+                              cli::is_defined("output") ? cli::settings["output"] : "-",
+                              cli::is_defined("input") ? cli::settings["input"] : "-");
+    }
+
+    emitter::set_globals(pp.get_globals());
+
     parser::init();
 
-    parser::parse();
+    if (!parser::parse()) error_exit();
+
+    if (cli::is_defined("optimize")) optimizer::optimize();
+
+    if (!emitter::assemble()) error_exit();
+
+    if (cli::is_defined("verify")) {
+        if (!disassembler::verify(emitter::detail::image, emitter::detail::program)) error_exit();
+    }
+
+    if (cli::is_defined("map") || cli::is_defined("map-text")) {
+        symmap::map m;
 
-    emitter::assemble();
+        m.build(emitter::detail::labels, pp.get_names(), emitter::detail::image_size);
+
+        if (cli::is_defined("map")) {
+            std::ofstream map_file(cli::settings["map"], std::ios::binary);
+            symmap::write(map_file, m);
+        }
+
+        if (cli::is_defined("map-text")) {
+            std::ofstream map_file(cli::settings["map-text"]);
+            symmap::write_text(map_file, m);
+        }
+    }
 
     lexer::release_stream();
 
     emitter::release_stream();
+
+    if (!trace::finish()) error_exit();
 }
\ No newline at end of file
@@ -0,0 +1,75 @@
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <cstdlib>
+
+#include "cli.hpp"
+#include "log.hpp"
+
+#include "global.hpp"
+
+#include "disassembler.hpp"
+#include "parallel.hpp"
+#include "symmap.hpp"
+
+
+static inline void error_exit() {
+    _log(error, "Disassembly terminated");
+
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, const char* argv[]) {
+    cli::init(argc, argv);
+
+    cli::parse();
+
+    if (!cli::is_defined("input")) {
+        _log(error, "%s: No input", __FUNCTION__);
+        error_exit();
+    }
+
+    std::ifstream input_file(cli::settings["input"], std::ios::binary);
+
+    if (!input_file.good()) {
+        _log(error, "%s: Couldn't open input file", __FUNCTION__);
+        error_exit();
+    }
+
+    std::vector <uint8_t> image((std::istreambuf_iterator<char>(input_file)), std::istreambuf_iterator<char>());
+
+    symmap::view map;
+
+    bool has_map = cli::is_defined("map");
+
+    if (has_map && !map.open(cli::settings["map"])) {
+        _log(error, "%s: Couldn't open map file", __FUNCTION__);
+        error_exit();
+    }
+
+    std::vector <disassembler::decoded> d = disassembler::disassemble(image.data(), image.size());
+
+    // Format the listing in chunks, one string per chunk
+    size_t chunks = parallel::thread_count(d.size()),
+           per_chunk = (d.size() + chunks - 1) / chunks;
+
+    std::vector <std::string> text(chunks);
+
+    parallel::parallel_for(chunks, [&](size_t c) {
+        for (size_t n = c * per_chunk; n < std::min(d.size(), (c + 1) * per_chunk); n++) {
+            if (has_map) {
+                const symmap::entry* e = map.lookup(d[n].address);
+                if (e && (e->address == d[n].address)) text[c] += std::string(".") + map.name(e) + ":\n";
+            }
+            text[c] += disassembler::format_line(d[n], image.data()) + "\n";
+        }
+    });
+
+    std::ofstream output_file;
+
+    if (cli::is_defined("output")) output_file.open(cli::settings["output"]);
+
+    std::ostream& output = cli::is_defined("output") ? output_file : std::cout;
+
+    for (std::string& s : text) output << s;
+}
\ No newline at end of file
@@ -0,0 +1,42 @@
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+
+#include "cli.hpp"
+#include "log.hpp"
+
+#include "linker.hpp"
+
+
+static inline void error_exit() {
+    _log(error, "Link terminated");
+
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, const char* argv[]) {
+    cli::init(argc, argv);
+
+    cli::parse();
+
+    // Everything that isn't a setting is an input object
+    if (!cli::cli.size()) {
+        _log(error, "%s: No input", __FUNCTION__);
+        error_exit();
+    }
+
+    linker::init(cli::cli);
+
+    std::ofstream output_file;
+
+    if (cli::is_defined("output")) {
+        output_file.open(cli::settings["output"], std::ios::binary);
+
+        if (!output_file.good()) {
+            _log(error, "%s: Couldn't open output file", __FUNCTION__);
+            error_exit();
+        }
+    }
+
+    if (!linker::link(cli::is_defined("output") ? output_file : std::cout)) error_exit();
+}
\ No newline at end of file
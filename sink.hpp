@@ -0,0 +1,249 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <ostream>
+#include <string>
+
+#include "parser.hpp"
+
+/*
+    Output sinks
+
+    The emitter feeds every encoded instruction to each registered sink in
+    a single pass, so any combination of formats costs one assembly. Sinks
+    format into fixed buffers, nothing is allocated per byte or per record.
+*/
+
+namespace sink {
+    namespace detail {
+        constexpr char digits[] = "0123456789abcdef",
+                       upper_digits[] = "0123456789ABCDEF";
+
+        // Writes the low <count> hex digits of value to out, returns the end of what was written
+        inline char* hex(char* out, uint64_t value, size_t count, const char* d = digits) {
+            for (size_t i = count; i-- > 0;) {
+                out[i] = d[value & 0xf];
+                value >>= 4;
+            }
+            return out + count;
+        }
+    }
+
+    class base {
+    public:
+        virtual ~base() = default;
+
+        // Called for every encoded instruction, in address order
+        virtual void put(uint64_t address, const uint8_t* p, size_t size, const parser::detail::instruction& i) = 0;
+
+        // Called for every label, before the instruction at its address
+        virtual void label(uint64_t, const std::string&) {}
+
+        // Called at the end of every emitter::assemble
+        virtual void flush() {}
+
+        // Called once when no more code will be emitted
+        virtual void finish() { flush(); }
+    };
+
+    // Raw bytes
+    class raw : public base {
+        std::ostream& o;
+
+    public:
+        raw(std::ostream& o) : o(o) {}
+
+        void put(uint64_t, const uint8_t* p, size_t size, const parser::detail::instruction&) override {
+            o.write((const char*)p, size);
+        }
+
+        void flush() override { o.flush(); }
+    };
+
+    // One line of hex digits per call to emitter::assemble
+    class hex : public base {
+        std::ostream& o;
+
+    public:
+        hex(std::ostream& o) : o(o) {}
+
+        void put(uint64_t, const uint8_t* p, size_t size, const parser::detail::instruction&) override {
+            char buf[16], *c = buf;
+            for (size_t i = 0; (i < size) && (i < 8); i++) c = detail::hex(c, p[i], 2);
+            o.write(buf, c - buf);
+        }
+
+        void flush() override { o.put('\n'); o.flush(); }
+
+        void finish() override { o.flush(); }
+    };
+
+    // Base for record formats, gathers contiguous bytes into records of up to 16 bytes
+    class record : public base {
+        uint8_t  data[16];
+        size_t   size = 0;
+        uint64_t start = 0;
+
+    protected:
+        std::ofstream o;
+
+        virtual void write_record(uint64_t address, const uint8_t* p, size_t size) = 0;
+
+        void flush_record() {
+            if (size) write_record(start, data, size);
+            size = 0;
+        }
+
+    public:
+        record(const std::string& fn) : o(fn) {}
+
+        bool good() const { return o.good(); }
+
+        void put(uint64_t address, const uint8_t* p, size_t count, const parser::detail::instruction&) override {
+            for (size_t i = 0; i < count; i++) {
+                if (size && (((start + size) != (address + i)) || (size == sizeof(data)))) flush_record();
+                if (!size) start = address + i;
+                data[size++] = p[i];
+            }
+        }
+
+        void flush() override { flush_record(); o.flush(); }
+    };
+
+    // Intel HEX, with extended linear address records above 64 KiB
+    class ihex : public record {
+        uint64_t upper = 0;
+
+        void write_line(uint8_t type, uint16_t address, const uint8_t* p, size_t size) {
+            char buf[64], *c = buf;
+            uint8_t sum = size + (address >> 8) + (address & 0xff) + type;
+
+            *c++ = ':';
+            c = detail::hex(c, size, 2, detail::upper_digits);
+            c = detail::hex(c, address, 4, detail::upper_digits);
+            c = detail::hex(c, type, 2, detail::upper_digits);
+
+            for (size_t i = 0; i < size; i++) {
+                c = detail::hex(c, p[i], 2, detail::upper_digits);
+                sum += p[i];
+            }
+
+            c = detail::hex(c, (uint8_t)-sum, 2, detail::upper_digits);
+            *c++ = '\n';
+
+            o.write(buf, c - buf);
+        }
+
+    protected:
+        void write_record(uint64_t address, const uint8_t* p, size_t size) override {
+            // Records can't cross a 64 KiB boundary
+            while (size) {
+                if ((address >> 16) != upper) {
+                    upper = address >> 16;
+                    uint8_t ela[2] = { (uint8_t)(upper >> 8), (uint8_t)upper };
+                    write_line(0x04, 0, ela, 2);
+                }
+
+                size_t n = std::min<size_t>(size, 0x10000 - (address & 0xffff));
+
+                write_line(0x00, address & 0xffff, p, n);
+
+                address += n; p += n; size -= n;
+            }
+        }
+
+    public:
+        using record::record;
+
+        void finish() override {
+            flush();
+            write_line(0x01, 0, nullptr, 0);
+            o.flush();
+        }
+    };
+
+    // Motorola S-record, S3 data records with 32-bit addresses
+    class srec : public record {
+        size_t count = 0;
+
+        void write_line(char type, uint32_t address, size_t address_size, const uint8_t* p, size_t size) {
+            char buf[64], *c = buf;
+            uint8_t length = address_size + size + 1,
+                    sum = length;
+
+            *c++ = 'S';
+            *c++ = type;
+            c = detail::hex(c, length, 2, detail::upper_digits);
+            c = detail::hex(c, address, address_size*2, detail::upper_digits);
+
+            for (size_t i = 0; i < address_size; i++) sum += (uint8_t)(address >> (i*8));
+
+            for (size_t i = 0; i < size; i++) {
+                c = detail::hex(c, p[i], 2, detail::upper_digits);
+                sum += p[i];
+            }
+
+            c = detail::hex(c, (uint8_t)~sum, 2, detail::upper_digits);
+            *c++ = '\n';
+
+            o.write(buf, c - buf);
+        }
+
+    protected:
+        void write_record(uint64_t address, const uint8_t* p, size_t size) override {
+            write_line('3', address, 4, p, size);
+            count++;
+        }
+
+    public:
+        srec(const std::string& fn) : record(fn) {
+            write_line('0', 0, 2, nullptr, 0);
+        }
+
+        void finish() override {
+            flush();
+            if (count <= 0xffff) write_line('5', count, 2, nullptr, 0);
+            write_line('7', 0, 4, nullptr, 0);
+            o.flush();
+        }
+    };
+
+    // Address, bytes and source of every instruction
+    class listing : public base {
+        std::ofstream o;
+
+    public:
+        listing(const std::string& fn) : o(fn) {}
+
+        bool good() const { return o.good(); }
+
+        void label(uint64_t, const std::string& name) override {
+            o << '.' << name << ":\n";
+        }
+
+        void put(uint64_t address, const uint8_t* p, size_t size, const parser::detail::instruction& i) override {
+            char buf[64], *c = buf;
+
+            c = detail::hex(c, address, 8);
+            *c++ = ' '; *c++ = ' ';
+
+            for (size_t n = 0; n < 8; n++) {
+                if (n < size) {
+                    c = detail::hex(c, p[n], 2);
+                } else {
+                    *c++ = ' '; *c++ = ' ';
+                }
+                *c++ = ' ';
+            }
+
+            *c++ = ' ';
+
+            o.write(buf, c - buf);
+            o << print_source(i) << '\n';
+        }
+
+        void flush() override { o.flush(); }
+    };
+}
\ No newline at end of file
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <istream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+
+#include "trace.hpp"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+    Source manager
+
+    Every source file is given a range in a single 32-bit offset space, so a
+    token only needs to carry one offset to know both its file and position.
+    Lines and columns are only worked out when a diagnostic is printed, from
+    a newline index that's built the first time a file needs one.
+*/
+
+namespace source {
+    // Offsets from here up belong to input that's lexed as it arrives and isn't kept, like stdin in line mode
+    constexpr uint32_t stream_base = 0x80000000;
+
+    namespace detail {
+        struct file {
+            std::string             name;
+            std::string             text;
+            uint32_t                base;
+
+            // Offset of the start of every line, built on first use
+            std::vector <uint32_t>  lines;
+            bool                    indexed = false;
+
+            file(const std::string& name, std::string text, uint32_t base) : name(name), text(std::move(text)), base(base) {}
+        };
+
+        std::deque <file>       files;
+        std::vector <uint32_t>  bases;
+        uint32_t                next_base = 0;
+
+        std::mutex              lock;
+
+        void index_lines(file& f) {
+            const char* p = f.text.data();
+            size_t n = f.text.size(), i = 0;
+
+            f.lines.push_back(0);
+
+#if defined(__SSE2__)
+            const __m128i nl = _mm_set1_epi8('\n');
+
+            for (; (i + 16) <= n; i += 16) {
+                unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i)), nl));
+
+                while (mask) {
+                    f.lines.push_back(i + __builtin_ctz(mask) + 1);
+                    mask &= mask - 1;
+                }
+            }
+#endif
+
+            for (; i < n; i++) {
+                if (p[i] == '\n') f.lines.push_back(i + 1);
+            }
+
+            f.indexed = true;
+        }
+    }
+
+    // Registers the text of a file, returns the offset its first character is given
+    uint32_t add(const std::string& name, std::string text) {
+        using namespace detail;
+
+        std::lock_guard <std::mutex> guard(lock);
+
+        uint32_t base = next_base;
+
+        // Leave a gap, so an offset just past the end still maps to this file
+        next_base += text.size() + 1;
+
+        files.emplace_back(name, std::move(text), base);
+        bases.push_back(base);
+
+        return base;
+    }
+
+    // Reads and registers everything left in a stream, returns its base offset
+    uint32_t add(const std::string& name, std::istream& in) {
+        trace::scope t("source::read", name);
+
+        return add(name, std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()));
+    }
+
+    // Text of the file registered at base, it stays valid for the rest of the run
+    const std::string& text(uint32_t base) {
+        using namespace detail;
+
+        std::lock_guard <std::mutex> guard(lock);
+
+        return files[std::lower_bound(bases.begin(), bases.end(), base) - bases.begin()].text;
+    }
+
+    // Reads a string in place
+    class istream : public std::istream {
+        struct buffer : std::streambuf {
+            buffer(const std::string& s) {
+                char* p = const_cast<char*>(s.data());
+                setg(p, p, p + s.size());
+            }
+        } buf;
+
+    public:
+        istream(const std::string& s) : std::istream(nullptr), buf(s) { rdbuf(&buf); }
+    };
+
+    // Formats offset as file:line:col, or as <stdin>+offset if it's not in a registered file
+    std::string locate(uint32_t offset) {
+        using namespace detail;
+
+        std::lock_guard <std::mutex> guard(lock);
+
+        if (offset >= stream_base) return "<stdin>+" + std::to_string(offset - stream_base);
+
+        auto b = std::upper_bound(bases.begin(), bases.end(), offset);
+
+        if (b == bases.begin()) return "<stdin>+" + std::to_string(offset);
+
+        file& f = files[(b - bases.begin()) - 1];
+
+        if (!f.indexed) index_lines(f);
+
+        uint32_t local = offset - f.base;
+
+        auto l = std::upper_bound(f.lines.begin(), f.lines.end(), local) - 1;
+
+        return f.name + ":" + std::to_string((l - f.lines.begin()) + 1) + ":" + std::to_string(local - *l + 1);
+    }
+}
\ No newline at end of file
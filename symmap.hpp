@@ -0,0 +1,223 @@
+#pragma once
+
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "object.hpp"
+#include "parser.hpp"
+
+/*
+    Symbol map
+
+    Binary layout, little-endian, every field naturally aligned so the file
+    can be mapped and used in place:
+
+        header (24 bytes):
+            "R64M" u16 version u16 reserved
+            u32 label count, u32 equ count, u32 string table size, u32 reserved
+
+        entries (24 bytes each):
+            u64 address, u64 size, u32 name offset, u32 kind
+
+        string table:
+            NUL-terminated names, indexed by the entries' name offset
+
+    Labels come first, sorted by address, then .equ names sorted by value.
+    A label covers the bytes up to the next label with a higher address (or
+    the end of the image), so an address can be looked up with a binary
+    search over the labels alone.
+*/
+
+namespace symmap {
+    constexpr char     magic[4] = { 'R', '6', '4', 'M' };
+    constexpr uint16_t version  = 1;
+
+    enum kind : uint32_t {
+        label = 0,
+        equ   = 1
+    };
+
+    struct header {
+        char        magic[4];
+        uint16_t    version;
+        uint16_t    reserved0;
+        uint32_t    label_count;
+        uint32_t    equ_count;
+        uint32_t    strings_size;
+        uint32_t    reserved1;
+    };
+
+    struct entry {
+        uint64_t    address;
+        uint64_t    size;
+        uint32_t    name;
+        uint32_t    kind;
+    };
+
+    static_assert(sizeof(header) == 24 && sizeof(entry) == 24);
+
+    struct map {
+        std::vector <entry> entries;
+        uint32_t            label_count = 0;
+        std::string         strings;
+
+        void build(const std::unordered_map <std::string, uint64_t>& labels,
+                   const std::unordered_map <std::string, std::string>& names,
+                   uint64_t end) {
+            auto add = [&](const std::string& n, uint64_t address, uint32_t k) {
+                entries.push_back({address, 0, (uint32_t)strings.size(), k});
+                strings += n;
+                strings += '\0';
+            };
+
+            for (auto& l : labels) add(l.first, l.second, kind::label);
+
+            label_count = entries.size();
+
+            // The preprocessor only keeps values parse_number accepts
+            for (auto& n : names) {
+                uint64_t value = 0;
+                parser::detail::parse_number(n.second, value);
+                add(n.first, value, kind::equ);
+            }
+
+            auto by_address = [&](const entry& a, const entry& b) {
+                return (a.address != b.address) ? (a.address < b.address) : (std::strcmp(name(a), name(b)) < 0);
+            };
+
+            std::sort(entries.begin(), entries.begin() + label_count, by_address);
+            std::sort(entries.begin() + label_count, entries.end(), by_address);
+
+            // Every label extends up to the next higher label address
+            for (size_t i = label_count; i-- > 0;) {
+                size_t n = i + 1;
+                while ((n < label_count) && (entries[n].address == entries[i].address)) n++;
+                entries[i].size = ((n < label_count) ? entries[n].address : end) - entries[i].address;
+            }
+        }
+
+        const char* name(const entry& e) const {
+            return strings.c_str() + e.name;
+        }
+    };
+
+    void write(std::ostream& o, const map& m) {
+        using namespace object::detail;
+
+        o.write(magic, sizeof(magic));
+        write_int(o, version);
+        write_int<uint16_t>(o, 0);
+        write_int<uint32_t>(o, m.label_count);
+        write_int<uint32_t>(o, m.entries.size() - m.label_count);
+        write_int<uint32_t>(o, m.strings.size());
+        write_int<uint32_t>(o, 0);
+
+        for (const entry& e : m.entries) {
+            write_int(o, e.address);
+            write_int(o, e.size);
+            write_int(o, e.name);
+            write_int(o, e.kind);
+        }
+
+        o.write(m.strings.data(), m.strings.size());
+    }
+
+    void write_text(std::ostream& o, const map& m) {
+        for (const entry& e : m.entries) {
+            o << std::setfill('0') << std::setw(16) << std::hex << e.address << std::dec << " "
+              << std::setfill(' ') << std::setw(8) << e.size << " "
+              << ((e.kind == kind::label) ? "label" : "equ  ") << " "
+              << m.name(e) << std::endl;
+        }
+    }
+
+    // Read-only view over a map file mapped into memory, assumes a little-endian host
+    class view {
+        const uint8_t*  base = nullptr;
+        size_t          size = 0;
+
+        const header* head() const {
+            return (const header*)base;
+        }
+
+        const entry* entries() const {
+            return (const entry*)(base + sizeof(header));
+        }
+
+        const char* strings() const {
+            return (const char*)(entries() + head()->label_count + head()->equ_count);
+        }
+
+    public:
+        view() = default;
+        view(const view&) = delete;
+        view& operator=(const view&) = delete;
+
+        ~view() {
+            if (base) munmap((void*)base, size);
+        }
+
+        // Returns false if the file can't be mapped or isn't a well-formed map
+        bool open(const std::string& fn) {
+            int fd = ::open(fn.c_str(), O_RDONLY);
+
+            if (fd < 0) return false;
+
+            struct stat st;
+
+            if (fstat(fd, &st) || ((size_t)st.st_size < sizeof(header))) { close(fd); return false; }
+
+            void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+            close(fd);
+
+            if (p == MAP_FAILED) return false;
+
+            base = (const uint8_t*)p;
+            size = st.st_size;
+
+            const header* h = head();
+
+            uint64_t expected = sizeof(header) + ((uint64_t)h->label_count + h->equ_count) * sizeof(entry) + h->strings_size;
+
+            return std::equal(magic, magic + sizeof(magic), h->magic) &&
+                   (h->version == version) && (expected == size) &&
+                   (!h->strings_size || !strings()[h->strings_size - 1]);
+        }
+
+        uint32_t label_count() const {
+            return head()->label_count;
+        }
+
+        // Returns the label whose region contains address, or nullptr
+        const entry* lookup(uint64_t address) const {
+            const entry *first = entries(),
+                        *last  = first + head()->label_count;
+
+            const entry* e = std::upper_bound(first, last, address, [](uint64_t a, const entry& e) {
+                return a < e.address;
+            });
+
+            if (e == first) return nullptr;
+
+            e--;
+
+            return (address < (e->address + e->size)) ? e : nullptr;
+        }
+
+        const char* name(const entry* e) const {
+            return strings() + e->name;
+        }
+    };
+}
\ No newline at end of file
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "log.hpp"
+
+/*
+    Timeline trace
+
+    Scoped events are recorded into a buffer owned by the thread they run
+    on, so recording never takes a lock; a thread only locks once, to
+    register its buffer the first time it records. The buffers are written
+    out together at the end of the run in Chrome trace JSON, which can be
+    loaded into chrome://tracing or Perfetto.
+
+    Recording is off unless init is called, a scope costs a single branch
+    then.
+*/
+
+namespace trace {
+    namespace detail {
+        typedef std::chrono::steady_clock clock;
+
+        struct event {
+            const char*     name;
+            std::string     detail;
+            uint64_t        start_ns,
+                            duration_ns;
+        };
+
+        struct buffer {
+            uint32_t                tid;
+            std::vector <event>     events;
+        };
+
+        bool enabled = false;
+
+        std::string file_name;
+
+        clock::time_point epoch;
+
+        // Every buffer ever registered, they outlive the threads that filled them
+        std::vector <std::unique_ptr <buffer>> buffers;
+        std::mutex lock;
+
+        thread_local buffer* local = nullptr;
+
+        buffer& get_buffer() {
+            if (!local) {
+                std::lock_guard <std::mutex> guard(lock);
+
+                buffers.push_back(std::make_unique<buffer>());
+                local = buffers.back().get();
+                local->tid = buffers.size() - 1;
+                local->events.reserve(256);
+            }
+
+            return *local;
+        }
+
+        inline uint64_t now() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - epoch).count();
+        }
+
+        void write_string(std::ostream& o, const std::string& s) {
+            o << '"';
+
+            for (char c : s) {
+                if ((c == '"') || (c == '\\')) {
+                    o << '\\' << c;
+                } else if ((unsigned char)c < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    o << buf;
+                } else {
+                    o << c;
+                }
+            }
+
+            o << '"';
+        }
+    }
+
+    // Starts recording, the trace is written to fn by finish
+    void init(const std::string& fn) {
+        using namespace detail;
+
+        file_name = fn;
+        epoch = clock::now();
+        enabled = true;
+
+        // The calling thread is the main thread, and gets tid 0
+        get_buffer();
+    }
+
+    // Records the time from its construction to its destruction as an event called name
+    class scope {
+        const char*     name;
+        std::string     info;
+        uint64_t        start = 0;
+
+    public:
+        // info is shown with the event, e.g. the file or chunk it worked on
+        scope(const char* name, std::string t_info = "") : name(name) {
+            if (!detail::enabled) return;
+            info = std::move(t_info);
+            start = detail::now();
+        }
+
+        // Calls info_of for the info only when recording, so it isn't formatted for nothing
+        template <class F> requires std::is_invocable_r_v<std::string, F&>
+        scope(const char* name, F&& info_of) : name(name) {
+            if (!detail::enabled) return;
+            info = info_of();
+            start = detail::now();
+        }
+
+        scope(const scope&) = delete;
+        scope& operator=(const scope&) = delete;
+
+        ~scope() {
+            if (!detail::enabled) return;
+            detail::get_buffer().events.push_back({name, std::move(info), start, detail::now() - start});
+        }
+    };
+
+    // Writes every recorded event as Chrome trace JSON, must be called once every worker has finished
+    void write(std::ostream& o) {
+        using namespace detail;
+
+        char buf[128];
+
+        o << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+        bool first = true;
+
+        for (auto& b : buffers) {
+            snprintf(buf, sizeof(buf), "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s %u\"}}",
+                     first ? "" : ",", b->tid, b->tid ? "worker" : "main", b->tid);
+            o << buf;
+
+            first = false;
+
+            for (event& e : b->events) {
+                snprintf(buf, sizeof(buf), ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%llu.%03u,\"dur\":%llu.%03u,\"name\":",
+                         b->tid, (unsigned long long)(e.start_ns / 1000), (unsigned)(e.start_ns % 1000),
+                         (unsigned long long)(e.duration_ns / 1000), (unsigned)(e.duration_ns % 1000));
+                o << buf;
+
+                write_string(o, e.name);
+
+                if (e.detail.size()) {
+                    o << ",\"args\":{\"detail\":";
+                    write_string(o, e.detail);
+                    o << "}";
+                }
+
+                o << "}";
+            }
+        }
+
+        o << "\n]}" << std::endl;
+    }
+
+    // Writes the trace if recording was started, returns 0 if the file can't be written
+    int finish() {
+        using namespace detail;
+
+        if (!enabled) return 1;
+
+        enabled = false;
+
+        std::ofstream file(file_name);
+
+        if (!file.good()) {
+            _log(error, "%s: Couldn't open trace file \"%s\"", __FUNCTION__, file_name.c_str());
+            return 0;
+        }
+
+        write(file);
+
+        return 1;
+    }
+}
\ No newline at end of file